@@ -0,0 +1,84 @@
+/*
+Microbenchmark for block allocation: fills a free map of each size the
+way fs_write() does, once with the original int-per-block linear scan
+and once with the packed bitmap, and reports allocations per second.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int legacy_alloc( int *map, int n )
+{
+	int i;
+	for(i=1;i<n;i++) {
+		if(map[i]==0) {
+			map[i] = 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static double bench_legacy( int nblocks, int rounds )
+{
+	int *map = malloc(nblocks*sizeof(int));
+	double start = now();
+	int r;
+
+	for(r=0;r<rounds;r++) {
+		memset(map,0,nblocks*sizeof(int));
+		map[0] = 1;
+		while(legacy_alloc(map,nblocks)>=0) {}
+	}
+
+	free(map);
+	return now()-start;
+}
+
+static double bench_bitmap( int nblocks, int rounds )
+{
+	struct bitmap b;
+	double start = now();
+	int r;
+
+	for(r=0;r<rounds;r++) {
+		bitmap_init(&b,nblocks);
+		bitmap_set(&b,0);
+		while(bitmap_alloc(&b)>=0) {}
+		bitmap_free(&b);
+	}
+
+	return now()-start;
+}
+
+int main( int argc, char *argv[] )
+{
+	static const int sizes[] = { 200, 2000, 20000, 65536 };
+	int i;
+
+	printf("%10s %8s %16s %16s %10s\n","nblocks","rounds","legacy allocs/s","bitmap allocs/s","map bytes");
+
+	for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		int n = sizes[i];
+		int rounds = 20000000/((double)n*n/2+1) + 1;
+		double tl = bench_legacy(n,rounds);
+		double tb = bench_bitmap(n,rounds);
+		double allocs = (double)(n-1)*rounds;
+
+		printf("%10d %8d %16.0f %16.0f %4d->%d\n",n,rounds,allocs/tl,allocs/tb,
+			(int)(n*sizeof(int)),(int)((n+63)/64*8));
+	}
+
+	return 0;
+}
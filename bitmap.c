@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+/*
+Bits are packed 64 to a word, set means in use.  The padding bits past
+nbits in the last word are kept set so the search never returns them.
+cursor is the word where the last allocation succeeded, giving a
+next-fit search that does not rescan the full prefix of the map.
+*/
+
+int bitmap_init( struct bitmap *b, int nbits )
+{
+	int extra;
+
+	b->nbits = nbits;
+	b->nwords = (nbits+63)/64;
+	b->nfree = nbits;
+	b->cursor = 0;
+	b->words = calloc(b->nwords ? b->nwords : 1,sizeof(uint64_t));
+	if(!b->words) return 0;
+
+	extra = b->nwords*64 - nbits;
+	if(extra) b->words[b->nwords-1] = ~0ull << (64-extra);
+
+	return 1;
+}
+
+void bitmap_free( struct bitmap *b )
+{
+	free(b->words);
+	b->words = 0;
+	b->nbits = b->nwords = b->nfree = b->cursor = 0;
+}
+
+int bitmap_test( const struct bitmap *b, int bit )
+{
+	return (b->words[bit/64] >> (bit%64)) & 1;
+}
+
+void bitmap_set( struct bitmap *b, int bit )
+{
+	uint64_t mask = 1ull << (bit%64);
+
+	if(!(b->words[bit/64] & mask)) {
+		b->words[bit/64] |= mask;
+		b->nfree--;
+	}
+}
+
+void bitmap_clear( struct bitmap *b, int bit )
+{
+	uint64_t mask = 1ull << (bit%64);
+
+	if(b->words[bit/64] & mask) {
+		b->words[bit/64] &= ~mask;
+		b->nfree++;
+	}
+}
+
+/*
+Claim one specific bit; returns 0 if it was already in use.
+*/
+
+int bitmap_take( struct bitmap *b, int bit )
+{
+	uint64_t mask = 1ull << (bit%64);
+
+	if(b->words[bit/64] & mask) return 0;
+	b->words[bit/64] |= mask;
+	b->nfree--;
+	return 1;
+}
+
+int bitmap_alloc( struct bitmap *b )
+{
+	int i, w, bit;
+
+	if(b->nfree<=0) return -1;
+
+	for(i=0;i<b->nwords;i++) {
+		w = b->cursor + i;
+		if(w>=b->nwords) w -= b->nwords;
+		if(b->words[w]!=~0ull) {
+			bit = w*64 + __builtin_ctzll(~b->words[w]);
+			b->words[w] |= 1ull << (bit%64);
+			b->nfree--;
+			b->cursor = w;
+			return bit;
+		}
+	}
+
+	return -1;
+}
+
+/*
+Restore the padding bits and the free count after the words have been
+filled in directly, e.g. when loading a saved map from disk.
+*/
+
+void bitmap_recount( struct bitmap *b )
+{
+	int i, extra;
+
+	extra = b->nwords*64 - b->nbits;
+	if(extra) b->words[b->nwords-1] |= ~0ull << (64-extra);
+
+	b->nfree = 0;
+	for(i=0;i<b->nwords;i++) {
+		b->nfree += 64 - __builtin_popcountll(b->words[i]);
+	}
+	b->cursor = 0;
+}
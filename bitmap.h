@@ -0,0 +1,23 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+struct bitmap {
+	uint64_t *words;
+	int nbits;
+	int nwords;
+	int nfree;
+	int cursor;
+};
+
+int  bitmap_init( struct bitmap *b, int nbits );
+void bitmap_free( struct bitmap *b );
+int  bitmap_test( const struct bitmap *b, int bit );
+void bitmap_set( struct bitmap *b, int bit );
+void bitmap_clear( struct bitmap *b, int bit );
+int  bitmap_alloc( struct bitmap *b );
+int  bitmap_take( struct bitmap *b, int bit );
+void bitmap_recount( struct bitmap *b );
+
+#endif
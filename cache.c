@@ -0,0 +1,733 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "cache.h"
+#include "trace.h"
+
+#define CACHE_INFLIGHT 8
+
+struct cache_frame {
+	int blocknum;
+	int dirty;
+	int referenced;
+	int busy;
+	int pins;
+	struct cache_frame *next;
+	char data[DISK_BLOCK_SIZE];
+};
+
+/*
+One lock covers the frame table, the hash chains and the statistics.
+Data is copied out of a frame with the lock dropped; the frame is
+pinned meanwhile so it cannot be reused underneath the copy.
+*/
+
+struct cache {
+	struct disk *disk;	/* null for the default cache until first use */
+	struct cache_frame *frames;
+	struct cache_frame **buckets;
+	int nframes;
+	int nbuckets;
+	int nwanted;
+	int hand;
+	struct cache_stats stats;
+	struct disk_batch *fills[CACHE_INFLIGHT];
+	int nfills;
+	pthread_mutex_t lock;
+	pthread_cond_t unpinned;	/* a frame's last pin went away */
+};
+
+/*
+The default cache serves the calls without a cache argument and sits
+on whichever image disk_init opened last.
+*/
+
+static struct cache deflt = { .nwanted = CACHE_DEFAULT_FRAMES, .lock = PTHREAD_MUTEX_INITIALIZER,
+	.unpinned = PTHREAD_COND_INITIALIZER };
+
+static void shutdown( struct cache *c );
+
+static int hash( struct cache *c, int blocknum )
+{
+	return (blocknum * 2654435761u) & (c->nbuckets-1);
+}
+
+static void disk_closing( void *arg )
+{
+	struct cache *c = arg;
+
+	pthread_mutex_lock(&c->lock);
+	shutdown(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int cache_setup( struct cache *c )
+{
+	int i;
+
+	if(c->frames) return 1;
+
+	if(c==&deflt) c->disk = disk_default();
+	disk_set_close_hook_r(c->disk,disk_closing,c);
+
+	c->nframes = c->nwanted;
+	if(c->nframes>disk_size_r(c->disk)) c->nframes = disk_size_r(c->disk);
+	if(c->nframes<1) c->nframes = 1;
+
+	c->nbuckets = 1;
+	while(c->nbuckets<c->nframes) c->nbuckets *= 2;
+
+	c->frames = malloc(c->nframes*sizeof(struct cache_frame));
+	c->buckets = calloc(c->nbuckets,sizeof(struct cache_frame *));
+	if(!c->frames || !c->buckets) {
+		printf("ERROR: couldn't allocate block cache: %d frames\n",c->nframes);
+		abort();
+	}
+
+	for(i=0;i<c->nframes;i++) {
+		c->frames[i].blocknum = -1;
+		c->frames[i].dirty = 0;
+		c->frames[i].referenced = 0;
+		c->frames[i].busy = 0;
+		c->frames[i].pins = 0;
+		c->frames[i].next = 0;
+	}
+
+	c->hand = 0;
+	c->nfills = 0;
+	memset(&c->stats,0,sizeof(c->stats));
+
+	return 1;
+}
+
+int cache_init( int n )
+{
+	if(n<1) return 0;
+	cache_close();
+	pthread_mutex_lock(&deflt.lock);
+	deflt.nwanted = n;
+	pthread_mutex_unlock(&deflt.lock);
+	return 1;
+}
+
+/*
+A cache of nframes blocks over d, with nothing allocated until first
+use.  It is written back by cache_close_r, or by disk_close_r on d if
+that comes first, though only cache_close_r frees it.
+*/
+
+struct cache * cache_open( struct disk *d, int nframes )
+{
+	struct cache *c;
+
+	if(nframes<1) return 0;
+
+	c = calloc(1,sizeof(*c));
+	if(!c) return 0;
+
+	c->disk = d;
+	c->nwanted = nframes;
+	pthread_mutex_init(&c->lock,0);
+	pthread_cond_init(&c->unpinned,0);
+
+	return c;
+}
+
+struct cache * cache_default()
+{
+	return &deflt;
+}
+
+/*
+Wait for every prefetch still in flight.  Frames being filled are
+marked busy and must not be read, written or reused until then.
+*/
+
+static void settle( struct cache *c )
+{
+	int i;
+
+	if(!c->nfills) return;
+
+	for(i=0;i<c->nfills;i++) disk_wait(c->fills[i]);
+	c->nfills = 0;
+
+	for(i=0;i<c->nframes;i++) c->frames[i].busy = 0;
+}
+
+static struct cache_frame * lookup( struct cache *c, int blocknum )
+{
+	struct cache_frame *f;
+
+	for(f=c->buckets[hash(c,blocknum)];f;f=f->next) {
+		if(f->blocknum==blocknum) return f;
+	}
+	return 0;
+}
+
+/*
+Like lookup, but the frame returned is safe to use.
+*/
+
+static struct cache_frame * find( struct cache *c, int blocknum )
+{
+	struct cache_frame *f = lookup(c,blocknum);
+
+	if(f && f->busy) settle(c);
+	return f;
+}
+
+static void unhash( struct cache *c, struct cache_frame *f )
+{
+	struct cache_frame **p = &c->buckets[hash(c,f->blocknum)];
+
+	while(*p!=f) p = &(*p)->next;
+	*p = f->next;
+	f->next = 0;
+}
+
+static void writeback( struct cache *c, struct cache_frame *f )
+{
+	trace(TRACE_CACHE,TRACE_DEBUG,"write back block %d",f->blocknum);
+	disk_write_r(c->disk,f->blocknum,f->data);
+	f->dirty = 0;
+	c->stats.writebacks++;
+}
+
+/*
+Pick a victim with the CLOCK algorithm: c->frames referenced since the
+c->hand last passed get a second chance, and pinned c->frames are passed
+over.  A dirty victim is written back before it is handed out.  Returns
+0 when two full turns of the hand find every frame pinned.
+*/
+
+static struct cache_frame * evict( struct cache *c )
+{
+	struct cache_frame *f = 0;
+	int n;
+
+	for(n=0;n<2*c->nframes;n++) {
+		f = &c->frames[c->hand];
+		c->hand = (c->hand+1)%c->nframes;
+		if(f->pins) continue;
+		if(f->referenced) {
+			f->referenced = 0;
+			continue;
+		}
+		break;
+	}
+	if(n==2*c->nframes) return 0;
+
+	if(f->busy) settle(c);
+
+	if(f->blocknum>=0) {
+		if(f->dirty) writeback(c,f);
+		trace(TRACE_CACHE,TRACE_DEBUG,"evict block %d",f->blocknum);
+		unhash(c,f);
+		c->stats.evictions++;
+	}
+
+	return f;
+}
+
+/*
+Give a frame from evict(c) its new identity.
+*/
+
+static void insert( struct cache *c, struct cache_frame *f, int blocknum )
+{
+	int h = hash(c,blocknum);
+
+	f->blocknum = blocknum;
+	f->dirty = 0;
+	f->referenced = 1;
+	f->next = c->buckets[h];
+	c->buckets[h] = f;
+}
+
+/*
+Drop a pin taken under c->lock, waking anyone waiting for a frame.
+*/
+
+static void unpin( struct cache *c, struct cache_frame *f )
+{
+	if(!--f->pins) pthread_cond_broadcast(&c->unpinned);
+}
+
+static struct cache_frame * cache_get( struct cache *c, int blocknum, int fill )
+{
+	struct cache_frame *f;
+
+	cache_setup(c);
+
+	while(1) {
+		f = find(c,blocknum);
+		if(f) {
+			c->stats.hits++;
+			f->referenced = 1;
+			return f;
+		}
+		f = evict(c);
+		if(f) break;
+		// every frame is pinned by a reader copying out of it; the
+		// block may be brought in by someone else meanwhile
+		pthread_cond_wait(&c->unpinned,&c->lock);
+	}
+
+	c->stats.misses++;
+	if(fill) disk_read_r(c->disk,blocknum,f->data);
+	insert(c,f,blocknum);
+
+	return f;
+}
+
+void cache_read_r( struct cache *c, int blocknum, char *data )
+{
+	struct cache_frame *f;
+	char *mapped;
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+
+	// the mapped image is already cached by the kernel, so a clean
+	// miss is served straight from it without taking a frame
+	if(disk_backend_r(c->disk)==DISK_BACKEND_MMAP) {
+		f = find(c,blocknum);
+		if(!f) {
+			c->stats.misses++;
+			pthread_mutex_unlock(&c->lock);
+			mapped = disk_block_r(c->disk,blocknum);
+			memcpy(data,mapped,DISK_BLOCK_SIZE);
+			return;
+		}
+	}
+
+	f = cache_get(c,blocknum,1);
+	f->pins++;
+	pthread_mutex_unlock(&c->lock);
+
+	memcpy(data,f->data,DISK_BLOCK_SIZE);
+
+	pthread_mutex_lock(&c->lock);
+	unpin(c,f);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_read( int blocknum, char *data )
+{
+	cache_read_r(&deflt,blocknum,data);
+}
+
+/*
+Read n blocks into the buffers given.  Cached blocks are copied out of
+their frames; all the others are fetched with one disk_readv straight
+into the caller's buffers and then installed in the cache so later
+reads still hit.
+*/
+
+void cache_readv_r( struct cache *c, struct disk_io *io, int n )
+{
+	struct disk_io stack[64], *miss = stack;
+	struct cache_frame *fstack[64], **hit = fstack;
+	struct cache_frame *f;
+	int i, nmiss = 0;
+
+	if(n>64) {
+		miss = malloc(n*sizeof(struct disk_io));
+		hit = malloc(n*sizeof(struct cache_frame *));
+		if(!miss || !hit) {
+			free(miss);
+			free(hit);
+			for(i=0;i<n;i++) cache_read_r(c,io[i].blocknum,io[i].data);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+	for(i=0;i<n;i++) {
+		f = find(c,io[i].blocknum);
+		if(f) {
+			c->stats.hits++;
+			f->referenced = 1;
+			f->pins++;
+		} else {
+			miss[nmiss++] = io[i];
+		}
+		hit[i] = f;
+	}
+	c->stats.misses += nmiss;
+	pthread_mutex_unlock(&c->lock);
+
+	for(i=0;i<n;i++) {
+		if(hit[i]) memcpy(io[i].data,hit[i]->data,DISK_BLOCK_SIZE);
+	}
+	disk_readv_r(c->disk,miss,nmiss);
+
+	pthread_mutex_lock(&c->lock);
+	for(i=0;i<n;i++) {
+		if(hit[i]) unpin(c,hit[i]);
+	}
+	if(disk_backend_r(c->disk)!=DISK_BACKEND_MMAP) {
+		for(i=0;i<nmiss;i++) {
+			// someone else may have brought it in meanwhile, or
+			// the same block was asked for twice
+			if(lookup(c,miss[i].blocknum)) continue;
+			f = evict(c);
+			if(!f) break;
+			memcpy(f->data,miss[i].data,DISK_BLOCK_SIZE);
+			insert(c,f,miss[i].blocknum);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(miss!=stack) {
+		free(miss);
+		free(hit);
+	}
+}
+
+void cache_readv( struct disk_io *io, int n )
+{
+	cache_readv_r(&deflt,io,n);
+}
+
+/*
+Read count consecutive blocks into data.
+*/
+
+void cache_read_run_r( struct cache *c, int blocknum, int count, char *data )
+{
+	struct disk_io io[64];
+	int i, n;
+
+	while(count>0) {
+		n = count<64 ? count : 64;
+		for(i=0;i<n;i++) {
+			io[i].blocknum = blocknum+i;
+			io[i].data = data+(size_t)i*DISK_BLOCK_SIZE;
+		}
+		cache_readv_r(c,io,n);
+		blocknum += n;
+		data += (size_t)n*DISK_BLOCK_SIZE;
+		count -= n;
+	}
+}
+
+void cache_read_run( int blocknum, int count, char *data )
+{
+	cache_read_run_r(&deflt,blocknum,count,data);
+}
+
+/*
+Start bringing count consecutive blocks into the cache ahead of use and
+return without waiting.  Blocks already cached are left alone.  The new
+frames are filled by a disk_submit batch and stay busy until something
+touches them and waits for it.  They start out referenced like any
+other fill: frames the reader has already consumed are just as likely
+to be referenced, so a clear bit would make CLOCK evict the prefetched
+blocks before they are used.  On the mmap backend the kernel is asked
+to fault the range in instead.
+*/
+
+void cache_prefetch_r( struct cache *c, int blocknum, int count )
+{
+	struct cache_frame **fresh;
+	struct disk_io *io;
+	int i, n = 0;
+
+	if(count<1) return;
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+
+	if(disk_backend_r(c->disk)==DISK_BACKEND_MMAP) {
+		disk_prefetch_r(c->disk,blocknum,count);
+		c->stats.readahead += count;
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+
+	// never prefetch more than half the cache, or the window would
+	// push out the blocks it was fetched for
+	if(count>c->nframes/2) count = c->nframes/2;
+
+	fresh = malloc(count*sizeof(fresh[0]));
+	io = malloc(count*sizeof(io[0]));
+	if(count<1 || !fresh || !io) {
+		pthread_mutex_unlock(&c->lock);
+		free(fresh);
+		free(io);
+		return;
+	}
+
+	if(c->nfills==CACHE_INFLIGHT) settle(c);
+
+	for(i=0;i<count;i++) {
+		if(lookup(c,blocknum+i)) continue;
+		fresh[n] = evict(c);
+		if(!fresh[n]) break;
+		insert(c,fresh[n],blocknum+i);
+		io[n].blocknum = blocknum+i;
+		io[n].data = fresh[n]->data;
+		n++;
+	}
+
+	// nothing may settle between here and the submit, or these
+	// frames would be released before the data is in them
+	if(n) {
+		for(i=0;i<n;i++) fresh[i]->busy = 1;
+		c->fills[c->nfills++] = disk_submit_r(c->disk,0,io,n);
+		c->stats.readahead += n;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	free(fresh);
+	free(io);
+}
+
+void cache_prefetch( int blocknum, int count )
+{
+	cache_prefetch_r(&deflt,blocknum,count);
+}
+
+void cache_write_r( struct cache *c, int blocknum, const char *data )
+{
+	struct cache_frame *f;
+
+	pthread_mutex_lock(&c->lock);
+	f = cache_get(c,blocknum,0);
+	memcpy(f->data,data,DISK_BLOCK_SIZE);
+	f->dirty = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	cache_write_r(&deflt,blocknum,data);
+}
+
+/*
+Write n blocks straight to the disk with one disk_writev.  Frames
+already holding any of them are updated and left clean, so the cache
+never writes a stale copy over the new data.
+*/
+
+void cache_writev_r( struct cache *c, struct disk_io *io, int n )
+{
+	struct cache_frame *f;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+	for(i=0;i<n;i++) {
+		f = find(c,io[i].blocknum);
+		if(f) {
+			memcpy(f->data,io[i].data,DISK_BLOCK_SIZE);
+			f->dirty = 0;
+		}
+	}
+	c->stats.writebacks += n;
+	pthread_mutex_unlock(&c->lock);
+
+	disk_writev_r(c->disk,io,n);
+}
+
+void cache_writev( struct disk_io *io, int n )
+{
+	cache_writev_r(&deflt,io,n);
+}
+
+void cache_flush_r( struct cache *c, int blocknum )
+{
+	struct cache_frame *f;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->frames) {
+		f = find(c,blocknum);
+		if(f && f->dirty) writeback(c,f);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_flush( int blocknum )
+{
+	cache_flush_r(&deflt,blocknum);
+}
+
+/*
+Host file transfers bypass the frames.  Going out, any dirty copies
+are written back first so the disk has the latest data; coming in,
+cached copies are dropped so nothing stale is read or written back
+over the new data.  The caller keeps anyone else away from the blocks
+while the transfer runs.
+*/
+
+int cache_copyout_r( struct cache *c, int blocknum, int count, int fd, int64_t offset )
+{
+	struct cache_frame *f;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+	for(i=0;i<count;i++) {
+		f = find(c,blocknum+i);
+		if(f && f->dirty) writeback(c,f);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return disk_copyout_r(c->disk,blocknum,count,fd,offset);
+}
+
+int cache_copyout( int blocknum, int count, int fd, int64_t offset )
+{
+	return cache_copyout_r(&deflt,blocknum,count,fd,offset);
+}
+
+static void drop_range( struct cache *c, int blocknum, int count )
+{
+	struct cache_frame *f;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	cache_setup(c);
+	for(i=0;i<count;i++) {
+		f = find(c,blocknum+i);
+		if(!f) continue;
+		// a pinned frame is still safe to copy from, and is
+		// reused only once it is let go
+		unhash(c,f);
+		f->blocknum = -1;
+		f->dirty = 0;
+		f->referenced = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+int cache_copyin_r( struct cache *c, int blocknum, int count, int fd, int64_t offset )
+{
+	drop_range(c,blocknum,count);
+	return disk_copyin_r(c->disk,blocknum,count,fd,offset);
+}
+
+int cache_copyin( int blocknum, int count, int fd, int64_t offset )
+{
+	return cache_copyin_r(&deflt,blocknum,count,fd,offset);
+}
+
+/*
+Blocks being discarded are dropped without being written back, whether
+or not the disk manages to punch them out; their contents are only
+known to be zeros when it returns 1.
+*/
+
+int cache_discard_r( struct cache *c, int blocknum, int count )
+{
+	drop_range(c,blocknum,count);
+	return disk_discard_r(c->disk,blocknum,count);
+}
+
+int cache_discard( int blocknum, int count )
+{
+	return cache_discard_r(&deflt,blocknum,count);
+}
+
+static void sync_frames( struct cache *c )
+{
+	struct disk_io *io;
+	int i, n=0;
+
+	if(!c->frames) return;
+
+	io = malloc(c->nframes*sizeof(struct disk_io));
+	if(!io) {
+		for(i=0;i<c->nframes;i++) {
+			if(c->frames[i].dirty) writeback(c,&c->frames[i]);
+		}
+		return;
+	}
+
+	// disk_writev puts the blocks in order and merges neighbours
+	for(i=0;i<c->nframes;i++) {
+		if(c->frames[i].dirty) {
+			io[n].blocknum = c->frames[i].blocknum;
+			io[n].data = c->frames[i].data;
+			c->frames[i].dirty = 0;
+			n++;
+		}
+	}
+	disk_writev_r(c->disk,io,n);
+	c->stats.writebacks += n;
+
+	free(io);
+}
+
+void cache_sync_r( struct cache *c )
+{
+	pthread_mutex_lock(&c->lock);
+	sync_frames(c);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_sync()
+{
+	cache_sync_r(&deflt);
+}
+
+/*
+Write back everything, report and free the frames.  The default cache
+comes back on its next use; any other is about to be freed.
+*/
+
+static void shutdown( struct cache *c )
+{
+	if(!c->frames) return;
+
+	settle(c);
+	sync_frames(c);
+
+	printf("%d cache hits\n",c->stats.hits);
+	printf("%d cache misses\n",c->stats.misses);
+	printf("%d cache evictions\n",c->stats.evictions);
+	if(c->stats.readahead) printf("%d blocks read ahead\n",c->stats.readahead);
+
+	free(c->frames);
+	free(c->buckets);
+	c->frames = 0;
+	c->buckets = 0;
+	c->nframes = 0;
+	disk_set_close_hook_r(c->disk,0,0);
+	if(c==&deflt) c->disk = 0;
+}
+
+void cache_close_r( struct cache *c )
+{
+	pthread_mutex_lock(&c->lock);
+	shutdown(c);
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->unpinned);
+	free(c);
+}
+
+void cache_close()
+{
+	pthread_mutex_lock(&deflt.lock);
+	shutdown(&deflt);
+	pthread_mutex_unlock(&deflt.lock);
+}
+
+void cache_get_stats_r( struct cache *c, struct cache_stats *s )
+{
+	pthread_mutex_lock(&c->lock);
+	*s = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_get_stats( struct cache_stats *s )
+{
+	cache_get_stats_r(&deflt,s);
+}
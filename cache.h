@@ -0,0 +1,55 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+
+#define CACHE_DEFAULT_FRAMES 1024
+
+struct cache_stats {
+	int hits;
+	int misses;
+	int evictions;
+	int writebacks;
+	int readahead;
+};
+
+struct cache;
+
+/*
+The calls without a cache argument use the default cache, which sits
+on the image opened by disk_init.  The _r versions work on a cache
+made by cache_open.
+*/
+
+int  cache_init( int nframes );
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_writev( struct disk_io *io, int n );
+void cache_readv( struct disk_io *io, int n );
+void cache_read_run( int blocknum, int count, char *data );
+void cache_prefetch( int blocknum, int count );
+void cache_sync();
+void cache_flush( int blocknum );
+int  cache_copyin( int blocknum, int count, int fd, int64_t offset );
+int  cache_copyout( int blocknum, int count, int fd, int64_t offset );
+int  cache_discard( int blocknum, int count );
+void cache_close();
+void cache_get_stats( struct cache_stats *s );
+
+struct cache *cache_open( struct disk *d, int nframes );
+struct cache *cache_default();
+void cache_read_r( struct cache *c, int blocknum, char *data );
+void cache_write_r( struct cache *c, int blocknum, const char *data );
+void cache_writev_r( struct cache *c, struct disk_io *io, int n );
+void cache_readv_r( struct cache *c, struct disk_io *io, int n );
+void cache_read_run_r( struct cache *c, int blocknum, int count, char *data );
+void cache_prefetch_r( struct cache *c, int blocknum, int count );
+void cache_sync_r( struct cache *c );
+void cache_flush_r( struct cache *c, int blocknum );
+int  cache_copyin_r( struct cache *c, int blocknum, int count, int fd, int64_t offset );
+int  cache_copyout_r( struct cache *c, int blocknum, int count, int fd, int64_t offset );
+int  cache_discard_r( struct cache *c, int blocknum, int count );
+void cache_close_r( struct cache *c );
+void cache_get_stats_r( struct cache *c, struct cache_stats *s );
+
+#endif
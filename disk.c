@@ -1,46 +1,185 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "disk.h"
+#include "trace.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_WORKERS 2
+
+/*
+One open image.  Everything that used to be process-wide lives here,
+so several images can be open at once; the original calls work on
+the image opened by disk_init, kept in current.
+*/
+
+struct disk {
+	int fd;
+	char *map;
+	int backend;
+	int nblocks;
+	int nreads;
+	int nwrites;
+	struct op_stats ops[DISK_NOPS];
+	int inflight;
+	void (*close_hook)( void *arg );
+	void *close_arg;
+};
+
+static struct disk *current = 0;
+
+struct disk_batch {
+	struct disk *d;
+	struct op_stats *op;	//filesystem call that queued it
+	int write;
+	int n;
+	int done;
+	struct disk_batch *next;
+	struct disk_io io[];
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static struct disk_batch *queue_head = 0;
+static struct disk_batch *queue_tail = 0;
+static pthread_t workers[DISK_WORKERS];
+static int nworkers = 0;
+static int stopping = 0;
+static int ndisks = 0;
+
+/*
+The image is sized with ftruncate alone, so a new image, or the part
+an old one grows by, is a hole that takes no space until written.
+*/
+
+static int open_image( struct disk *d, const char *filename, int n )
+{
+	struct stat st;
+
+	d->fd = open(filename,O_RDWR|O_CREAT,0666);
+	if(d->fd<0) return 0;
+
+	if(fstat(d->fd,&st)<0 || (st.st_size!=(off_t)n*DISK_BLOCK_SIZE &&
+	   ftruncate(d->fd,(off_t)n*DISK_BLOCK_SIZE)<0)) {
+		close(d->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int map_image( struct disk *d, const char *filename, int n )
+{
+	if(n<=0 || !open_image(d,filename,n)) return 0;
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+	d->map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+	if(d->map==MAP_FAILED) {
+		d->map = 0;
+		close(d->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+Open an image of n blocks with the backend given, creating or resizing
+the file as needed.  Returns null with errno set on failure.
+*/
+
+struct disk * disk_open( const char *filename, int n, int b )
+{
+	struct disk *d;
+	int ok, err;
+
+	d = calloc(1,sizeof(*d));
+	if(!d) return 0;
+
+	if(b==DISK_BACKEND_MMAP) {
+		ok = map_image(d,filename,n);
+	} else {
+		ok = open_image(d,filename,n);
+	}
+	if(!ok) {
+		err = errno;
+		free(d);
+		errno = err;
+		return 0;
+	}
+
+	d->backend = b;
+	d->nblocks = n;
+
+	pthread_mutex_lock(&queue_lock);
+	ndisks++;
+	pthread_mutex_unlock(&queue_lock);
+
+	return d;
+}
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_backend(filename,n,DISK_BACKEND_STDIO);
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+int disk_init_backend( const char *filename, int n, int b )
+{
+	struct disk *d = disk_open(filename,n,b);
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+	if(!d) return 0;
+	if(current) disk_close_r(current);
+	current = d;
 
 	return 1;
 }
 
+struct disk * disk_default()
+{
+	return current;
+}
+
+int disk_size_r( struct disk *d )
+{
+	return d->nblocks;
+}
+
 int disk_size()
 {
-	return nblocks;
+	return current ? current->nblocks : 0;
 }
 
-static void sanity_check( int blocknum, const void *data )
+int disk_backend_r( struct disk *d )
+{
+	return d->backend;
+}
+
+int disk_backend()
+{
+	return current ? current->backend : DISK_BACKEND_STDIO;
+}
+
+static void sanity_check( struct disk *d, int blocknum, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
+	if(blocknum>=d->nblocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
 		abort();
 	}
@@ -51,41 +190,654 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+/*
+Count n blocks moved by one of the op kinds, and charge them to the
+filesystem call this thread is in, if any.
+*/
+
+static void tally( struct disk *d, int op, int write, int n )
+{
+	trace(TRACE_DISK,TRACE_DEBUG,write ? "wrote %d blocks" : "read %d blocks",n);
+	__atomic_fetch_add(write ? &d->nwrites : &d->nreads,n,__ATOMIC_RELAXED);
+	stats_blocks(&d->ops[op],write,n);
+	stats_blocks(stats_current(),write,n);
+}
+
+/*
+Move iovcnt buffers to or from the image starting at blocknum with as
+few preadv/pwritev calls as the kernel allows.  The calls carry their
+own offset, so nothing depends on a shared file position.
+*/
+
+static void transfer( struct disk *d, int write, int blocknum, struct iovec *iov, int iovcnt )
+{
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	ssize_t result;
+
+	while(iovcnt>0) {
+		if(write) {
+			result = pwritev(d->fd,iov,iovcnt,offset);
+		} else {
+			result = preadv(d->fd,iov,iovcnt,offset);
+		}
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",result<0 ? strerror(errno) : "short transfer");
+			abort();
+		}
+
+		offset += result;
+		while(iovcnt>0 && (size_t)result>=iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char *)iov->iov_base+result;
+			iov->iov_len -= result;
+		}
+	}
+}
+
+void disk_read_r( struct disk *d, int blocknum, char *data )
+{
+	disk_read_blocks_r(d,blocknum,1,data);
+}
+
 void disk_read( int blocknum, char *data )
 {
-	sanity_check(blocknum,data);
+	disk_read_blocks_r(current,blocknum,1,data);
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_write_r( struct disk *d, int blocknum, const char *data )
+{
+	disk_write_blocks_r(d,blocknum,1,data);
+}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+void disk_write( int blocknum, const char *data )
+{
+	disk_write_blocks_r(current,blocknum,1,data);
+}
+
+/*
+Contiguous multi-block transfers: one pread/pwrite (or one memcpy on
+the mmap backend) for count blocks starting at blocknum.
+*/
+
+void disk_read_blocks_r( struct disk *d, int blocknum, int count, char *data )
+{
+	uint64_t start = stats_clock();
+	struct iovec iov;
+
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+
+	if(d->map) {
+		memcpy(data,d->map+(size_t)blocknum*DISK_BLOCK_SIZE,(size_t)count*DISK_BLOCK_SIZE);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		iov.iov_base = data;
+		iov.iov_len = (size_t)count*DISK_BLOCK_SIZE;
+		transfer(d,0,blocknum,&iov,1);
 	}
+	tally(d,DISK_OP_READ,0,count);
+	stats_record(&d->ops[DISK_OP_READ],start,(int64_t)count*DISK_BLOCK_SIZE);
 }
 
-void disk_write( int blocknum, const char *data )
+void disk_read_blocks( int blocknum, int count, char *data )
+{
+	disk_read_blocks_r(current,blocknum,count,data);
+}
+
+void disk_write_blocks_r( struct disk *d, int blocknum, int count, const char *data )
 {
-	sanity_check(blocknum,data);
+	uint64_t start = stats_clock();
+	struct iovec iov;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(d->map) {
+		memcpy(d->map+(size_t)blocknum*DISK_BLOCK_SIZE,data,(size_t)count*DISK_BLOCK_SIZE);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		iov.iov_base = (char *)data;
+		iov.iov_len = (size_t)count*DISK_BLOCK_SIZE;
+		transfer(d,1,blocknum,&iov,1);
+	}
+	tally(d,DISK_OP_WRITE,1,count);
+	stats_record(&d->ops[DISK_OP_WRITE],start,(int64_t)count*DISK_BLOCK_SIZE);
+}
+
+void disk_write_blocks( int blocknum, int count, const char *data )
+{
+	disk_write_blocks_r(current,blocknum,count,data);
+}
+
+static int compare_io( const void *a, const void *b )
+{
+	const struct disk_io *ia = *(struct disk_io * const *)a;
+	const struct disk_io *ib = *(struct disk_io * const *)b;
+	return (ia->blocknum>ib->blocknum) - (ia->blocknum<ib->blocknum);
+}
+
+/*
+Scatter-gather transfer of n blocks, each with its own buffer.  The
+requests are put in block order and every run of adjacent block
+numbers goes out as a single preadv/pwritev.  The same block must not
+appear twice in one batch.
+*/
+
+static void vectored( struct disk *d, int write, struct disk_io *io, int n )
+{
+	struct disk_io *stack[64], **sorted = stack;
+	struct iovec iov[64], *v = iov;
+	int op = write ? DISK_OP_WRITEV : DISK_OP_READV;
+	uint64_t start = stats_clock();
+	int i, j, k, run;
+
+	if(n<=0) return;
+
+	for(i=0;i<n;i++) sanity_check(d,io[i].blocknum,io[i].data);
+
+	if(d->map) {
+		for(i=0;i<n;i++) {
+			char *block = d->map+(size_t)io[i].blocknum*DISK_BLOCK_SIZE;
+			if(write) {
+				memcpy(block,io[i].data,DISK_BLOCK_SIZE);
+			} else {
+				memcpy(io[i].data,block,DISK_BLOCK_SIZE);
+			}
+		}
+		tally(d,op,write,n);
+		stats_record(&d->ops[op],start,(int64_t)n*DISK_BLOCK_SIZE);
+		return;
+	}
+
+	if(n>64) {
+		sorted = malloc(n*sizeof(sorted[0]));
+		v = malloc(n*sizeof(v[0]));
+		if(!sorted || !v) {
+			printf("ERROR: couldn't allocate %d block transfer\n",n);
+			abort();
+		}
+	}
+
+	for(i=0;i<n;i++) sorted[i] = &io[i];
+	qsort(sorted,n,sizeof(sorted[0]),compare_io);
+
+	for(i=0;i<n;i=j) {
+		for(j=i+1;j<n && sorted[j]->blocknum==sorted[j-1]->blocknum+1;j++) {}
+		for(k=i;k<j;k++) {
+			v[k].iov_base = sorted[k]->data;
+			v[k].iov_len = DISK_BLOCK_SIZE;
+		}
+		for(k=i;k<j;k+=run) {
+			run = j-k;
+			if(run>IOV_MAX) run = IOV_MAX;
+			transfer(d,write,sorted[k]->blocknum,&v[k],run);
+		}
+	}
+	tally(d,op,write,n);
+
+	if(sorted!=stack) {
+		free(sorted);
+		free(v);
+	}
+	stats_record(&d->ops[op],start,(int64_t)n*DISK_BLOCK_SIZE);
+}
+
+void disk_readv_r( struct disk *d, struct disk_io *io, int n )
+{
+	vectored(d,0,io,n);
+}
+
+void disk_readv( struct disk_io *io, int n )
+{
+	vectored(current,0,io,n);
+}
+
+void disk_writev_r( struct disk *d, struct disk_io *io, int n )
+{
+	vectored(d,1,io,n);
+}
+
+void disk_writev( struct disk_io *io, int n )
+{
+	vectored(current,1,io,n);
+}
+
+/*
+Asynchronous batches are carried out by a small pool of worker threads
+started on first use and shared by every open image.  Each batch runs
+as one disk_readv/disk_writev, so it gets the same merging as the
+synchronous calls.
+*/
+
+static void * worker( void *arg )
+{
+	struct disk_batch *b;
+
+	pthread_mutex_lock(&queue_lock);
+	while(1) {
+		while(!queue_head && !stopping) pthread_cond_wait(&queue_ready,&queue_lock);
+		if(!queue_head) break;
+
+		b = queue_head;
+		queue_head = b->next;
+		if(!queue_head) queue_tail = 0;
+		pthread_mutex_unlock(&queue_lock);
+
+		stats_set_current(b->op);
+		vectored(b->d,b->write,b->io,b->n);
+		stats_set_current(0);
+
+		pthread_mutex_lock(&queue_lock);
+		b->d->inflight--;
+		b->done = 1;
+		pthread_cond_broadcast(&batch_done);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+static void start_workers()
+{
+	while(nworkers<DISK_WORKERS) {
+		if(pthread_create(&workers[nworkers],0,worker,0)!=0) break;
+		nworkers++;
+	}
+}
+
+/*
+Queue n block transfers and return at once.  The disk_io array is
+copied, but the buffers it points to must stay put until disk_wait()
+returns for the batch.  If no worker thread can be started, the batch
+is carried out before disk_submit returns.
+*/
+
+struct disk_batch * disk_submit_r( struct disk *d, int write, const struct disk_io *io, int n )
+{
+	struct disk_batch *b;
+
+	b = malloc(sizeof(*b)+n*sizeof(struct disk_io));
+	if(!b) {
+		printf("ERROR: couldn't allocate %d block transfer\n",n);
 		abort();
 	}
+	b->d = d;
+	b->op = stats_current();
+	b->write = write;
+	b->n = n;
+	b->done = 0;
+	b->next = 0;
+	memcpy(b->io,io,n*sizeof(struct disk_io));
+
+	pthread_mutex_lock(&queue_lock);
+	start_workers();
+	if(!nworkers) {
+		pthread_mutex_unlock(&queue_lock);
+		vectored(d,write,b->io,n);
+		b->done = 1;
+		return b;
+	}
+	d->inflight++;
+	if(queue_tail) {
+		queue_tail->next = b;
+	} else {
+		queue_head = b;
+	}
+	queue_tail = b;
+	pthread_cond_signal(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+
+	return b;
 }
 
-void disk_close()
+struct disk_batch * disk_submit( int write, const struct disk_io *io, int n )
+{
+	return disk_submit_r(current,write,io,n);
+}
+
+int disk_done( struct disk_batch *b )
+{
+	int done;
+
+	pthread_mutex_lock(&queue_lock);
+	done = b->done;
+	pthread_mutex_unlock(&queue_lock);
+
+	return done;
+}
+
+void disk_wait( struct disk_batch *b )
+{
+	pthread_mutex_lock(&queue_lock);
+	while(!b->done) pthread_cond_wait(&batch_done,&queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+
+	free(b);
+}
+
+static void stop_workers()
+{
+	int i;
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+
+	for(i=0;i<nworkers;i++) pthread_join(workers[i],0);
+	nworkers = 0;
+	stopping = 0;
+}
+
+/*
+Zero-copy access for the mmap backend: returns a pointer straight into
+the mapped image, valid until disk_close().  Stores through the pointer
+reach the image on the next msync.  Returns null for the stdio backend,
+where callers must fall back to disk_read/disk_write.
+*/
+
+char * disk_block_r( struct disk *d, int blocknum )
+{
+	uint64_t start = stats_clock();
+
+	sanity_check(d,blocknum,d->map ? d->map : "");
+
+	if(!d->map) return 0;
+
+	tally(d,DISK_OP_BLOCK,0,1);
+	stats_record(&d->ops[DISK_OP_BLOCK],start,DISK_BLOCK_SIZE);
+	return d->map+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+char * disk_block( int blocknum )
+{
+	return disk_block_r(current,blocknum);
+}
+
+/*
+Hint that count blocks starting at blocknum will be read soon.  On the
+mmap backend the kernel starts paging the range in; on stdio there is
+nothing to do, since the cache reads the blocks itself.
+*/
+
+void disk_prefetch_r( struct disk *d, int blocknum, int count )
+{
+	uint64_t now = stats_clock();
+	size_t start, end;
+	long page = sysconf(_SC_PAGESIZE);
+
+	sanity_check(d,blocknum,"");
+	sanity_check(d,blocknum+count-1,"");
+
+	if(!d->map) return;
+
+	start = (size_t)blocknum*DISK_BLOCK_SIZE;
+	end = start+(size_t)count*DISK_BLOCK_SIZE;
+	start -= start%page;
+	madvise(d->map+start,end-start,MADV_WILLNEED);
+	stats_record(&d->ops[DISK_OP_PREFETCH],now,(int64_t)count*DISK_BLOCK_SIZE);
+}
+
+void disk_prefetch( int blocknum, int count )
+{
+	disk_prefetch_r(current,blocknum,count);
+}
+
+/*
+Copy len bytes between two files at the offsets given, leaving both
+file positions alone.  copy_file_range keeps the data in the kernel,
+and may share extents on filesystems that can; where it refuses the
+pair of files the copy goes through a buffer instead.
+*/
+
+static int copy_range( int from, off_t fromoff, int to, off_t tooff, size_t len )
+{
+	char *buf = 0;
+	ssize_t n, w;
+
+	while(len>0) {
+		n = copy_file_range(from,&fromoff,to,&tooff,len,0);
+		if(n<0 && errno==EINTR) continue;
+		if(n<=0) break;
+		len -= n;
+	}
+	if(!len) return 1;
+
+	buf = malloc(DISK_BLOCK_SIZE*16);
+	if(!buf) return 0;
+	while(len>0) {
+		n = pread(from,buf,len<DISK_BLOCK_SIZE*16 ? len : DISK_BLOCK_SIZE*16,fromoff);
+		if(n<0 && errno==EINTR) continue;
+		if(n<=0) break;
+		for(w=0;w<n;) {
+			ssize_t r = pwrite(to,buf+w,n-w,tooff+w);
+			if(r<0 && errno==EINTR) continue;
+			if(r<=0) break;
+			w += r;
+		}
+		if(w<n) break;
+		fromoff += n;
+		tooff += n;
+		len -= n;
+	}
+	free(buf);
+	return len==0;
+}
+
+/*
+Move count blocks starting at blocknum to or from a host file at
+offset, without bringing the data into user space on the stdio backend
+and with a single copy on mmap.  Returns 0 if the host file could not
+supply or take all of it.
+*/
+
+int disk_copyin_r( struct disk *d, int blocknum, int count, int fd, int64_t offset )
+{
+	uint64_t start = stats_clock();
+	size_t len = (size_t)count*DISK_BLOCK_SIZE, done = 0;
+	ssize_t n;
+
+	sanity_check(d,blocknum,"");
+	sanity_check(d,blocknum+count-1,"");
+
+	if(d->map) {
+		while(done<len) {
+			n = pread(fd,d->map+(size_t)blocknum*DISK_BLOCK_SIZE+done,len-done,offset+done);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0) break;
+			done += n;
+		}
+		if(done<len) return 0;
+	} else if(!copy_range(fd,offset,d->fd,(off_t)blocknum*DISK_BLOCK_SIZE,len)) {
+		return 0;
+	}
+	tally(d,DISK_OP_COPYIN,1,count);
+	stats_record(&d->ops[DISK_OP_COPYIN],start,len);
+	return 1;
+}
+
+int disk_copyin( int blocknum, int count, int fd, int64_t offset )
+{
+	return disk_copyin_r(current,blocknum,count,fd,offset);
+}
+
+int disk_copyout_r( struct disk *d, int blocknum, int count, int fd, int64_t offset )
+{
+	uint64_t start = stats_clock();
+	size_t len = (size_t)count*DISK_BLOCK_SIZE, done = 0;
+	ssize_t n;
+
+	sanity_check(d,blocknum,"");
+	sanity_check(d,blocknum+count-1,"");
+
+	if(d->map) {
+		while(done<len) {
+			n = pwrite(fd,d->map+(size_t)blocknum*DISK_BLOCK_SIZE+done,len-done,offset+done);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0) break;
+			done += n;
+		}
+		if(done<len) return 0;
+	} else if(!copy_range(d->fd,(off_t)blocknum*DISK_BLOCK_SIZE,fd,offset,len)) {
+		return 0;
+	}
+	tally(d,DISK_OP_COPYOUT,0,count);
+	stats_record(&d->ops[DISK_OP_COPYOUT],start,len);
+	return 1;
+}
+
+int disk_copyout( int blocknum, int count, int fd, int64_t offset )
+{
+	return disk_copyout_r(current,blocknum,count,fd,offset);
+}
+
+/*
+Hand count blocks starting at blocknum back to the host by punching
+them out of the image, so they take no space and read back as zeros.
+Returns 0 if the file system under the image can't punch holes, in
+which case the blocks are left as they were.
+*/
+
+int disk_discard_r( struct disk *d, int blocknum, int count )
+{
+	uint64_t start = stats_clock();
+	int result;
+
+	if(count<1) return 1;
+	sanity_check(d,blocknum,"");
+	sanity_check(d,blocknum+count-1,"");
+
+	do {
+		result = fallocate(d->fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+			(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE);
+	} while(result<0 && errno==EINTR);
+	if(result<0) return 0;
+
+	trace(TRACE_DISK,TRACE_DEBUG,"discarded %d blocks at %d",count,blocknum);
+	stats_record(&d->ops[DISK_OP_DISCARD],start,(int64_t)count*DISK_BLOCK_SIZE);
+	return 1;
+}
+
+int disk_discard( int blocknum, int count )
+{
+	return disk_discard_r(current,blocknum,count);
+}
+
+/*
+Blocks of the image the host has actually stored, which is less than
+its size wherever the image is sparse.
+*/
+
+int disk_allocated_r( struct disk *d )
+{
+	struct stat st;
+
+	if(fstat(d->fd,&st)<0) return -1;
+	return (int)((int64_t)st.st_blocks*512/DISK_BLOCK_SIZE);
+}
+
+int disk_allocated()
+{
+	return current ? disk_allocated_r(current) : -1;
+}
+
+/*
+Blocks moved so far, counting each block of a multi-block transfer,
+and the calls, bytes and latencies of each kind of operation.  A reset
+clears the per-operation figures; the block totals run for as long as
+the image is open.
+*/
+
+void disk_get_stats_r( struct disk *d, struct disk_stats *s )
+{
+	s->reads = __atomic_load_n(&d->nreads,__ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&d->nwrites,__ATOMIC_RELAXED);
+	stats_copy(s->op,d->ops,DISK_NOPS);
+}
+
+void disk_get_stats( struct disk_stats *s )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	if(current) {
+		disk_get_stats_r(current,s);
+	} else {
+		memset(s,0,sizeof(*s));
+	}
+}
+
+void disk_reset_stats_r( struct disk *d )
+{
+	stats_clear(d->ops,DISK_NOPS);
+}
+
+void disk_reset_stats()
+{
+	if(current) disk_reset_stats_r(current);
+}
+
+const char * disk_op_name( int op )
+{
+	static const char * const names[DISK_NOPS] = {
+		"read", "write", "readv", "writev", "block", "prefetch", "copyin", "copyout", "discard"
+	};
+	return op>=0 && op<DISK_NOPS ? names[op] : "?";
+}
+
+/*
+The hook runs at the start of disk_close, while the image can still be
+written, so a cache sitting on top can flush itself.
+*/
+
+void disk_set_close_hook_r( struct disk *d, void (*hook)( void *arg ), void *arg )
+{
+	d->close_hook = hook;
+	d->close_arg = arg;
+}
+
+static void (*legacy_hook)() = 0;
+
+static void call_legacy_hook( void *arg )
+{
+	legacy_hook();
+}
+
+void disk_set_close_hook( void (*hook)() )
+{
+	legacy_hook = hook;
+	if(current) disk_set_close_hook_r(current,hook ? call_legacy_hook : 0,0);
+}
+
+void disk_close_r( struct disk *d )
+{
+	int last;
+
+	if(d->close_hook) d->close_hook(d->close_arg);
+	printf("%d disk block reads\n",d->nreads);
+	printf("%d disk block writes\n",d->nwrites);
+
+	// batches for this image finish before it goes away, and the
+	// workers exit with the last image
+	pthread_mutex_lock(&queue_lock);
+	while(d->inflight) pthread_cond_wait(&batch_done,&queue_lock);
+	last = --ndisks==0;
+	pthread_mutex_unlock(&queue_lock);
+	if(last) stop_workers();
+
+	if(d->map) {
+		if(msync(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC)<0) {
+			printf("ERROR: couldn't flush simulated disk: %s\n",strerror(errno));
+		}
+		munmap(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE);
 	}
+
+	close(d->fd);
+	if(d==current) current = 0;
+	free(d);
 }
 
+void disk_close()
+{
+	if(current) disk_close_r(current);
+}
@@ -1,13 +1,91 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "stats.h"
+
 #define DISK_BLOCK_SIZE 4096
 
+#define DISK_BACKEND_STDIO 0
+#define DISK_BACKEND_MMAP  1
+
+struct disk_io {
+	int blocknum;
+	char *data;
+};
+
+#define DISK_OP_READ     0	//disk_read and disk_read_blocks
+#define DISK_OP_WRITE    1
+#define DISK_OP_READV    2	//disk_readv and asynchronous read batches
+#define DISK_OP_WRITEV   3
+#define DISK_OP_BLOCK    4	//disk_block on the mmap backend
+#define DISK_OP_PREFETCH 5
+#define DISK_OP_COPYIN   6	//disk_copyin, blocks filled from a host file
+#define DISK_OP_COPYOUT  7
+#define DISK_OP_DISCARD  8	//disk_discard, blocks punched out of the image
+#define DISK_NOPS        9
+
+struct disk_stats {
+	int reads;
+	int writes;
+	struct op_stats op[DISK_NOPS];
+};
+
+struct disk;
+struct disk_batch;
+
+/*
+The calls without a disk argument act on the image opened by
+disk_init; the _r versions take the image to use, so any number can
+be open at once.
+*/
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
+int  disk_backend();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_blocks( int blocknum, int count, char *data );
+void disk_write_blocks( int blocknum, int count, const char *data );
+void disk_readv( struct disk_io *io, int n );
+void disk_writev( struct disk_io *io, int n );
+struct disk_batch *disk_submit( int write, const struct disk_io *io, int n );
+int  disk_done( struct disk_batch *b );
+void disk_wait( struct disk_batch *b );
+char *disk_block( int blocknum );
+void disk_prefetch( int blocknum, int count );
+int  disk_copyin( int blocknum, int count, int fd, int64_t offset );
+int  disk_copyout( int blocknum, int count, int fd, int64_t offset );
+int  disk_discard( int blocknum, int count );
+int  disk_allocated();
 void disk_close();
+void disk_get_stats( struct disk_stats *s );
+void disk_reset_stats();
+const char *disk_op_name( int op );
+
+void disk_set_close_hook( void (*hook)() );
+
+struct disk *disk_open( const char *filename, int nblocks, int backend );
+struct disk *disk_default();
+int  disk_size_r( struct disk *d );
+int  disk_backend_r( struct disk *d );
+void disk_read_r( struct disk *d, int blocknum, char *data );
+void disk_write_r( struct disk *d, int blocknum, const char *data );
+void disk_read_blocks_r( struct disk *d, int blocknum, int count, char *data );
+void disk_write_blocks_r( struct disk *d, int blocknum, int count, const char *data );
+void disk_readv_r( struct disk *d, struct disk_io *io, int n );
+void disk_writev_r( struct disk *d, struct disk_io *io, int n );
+struct disk_batch *disk_submit_r( struct disk *d, int write, const struct disk_io *io, int n );
+char *disk_block_r( struct disk *d, int blocknum );
+void disk_prefetch_r( struct disk *d, int blocknum, int count );
+int  disk_copyin_r( struct disk *d, int blocknum, int count, int fd, int64_t offset );
+int  disk_copyout_r( struct disk *d, int blocknum, int count, int fd, int64_t offset );
+int  disk_discard_r( struct disk *d, int blocknum, int count );
+int  disk_allocated_r( struct disk *d );
+void disk_close_r( struct disk *d );
+void disk_get_stats_r( struct disk *d, struct disk_stats *s );
+void disk_reset_stats_r( struct disk *d );
 
+void disk_set_close_hook_r( struct disk *d, void (*hook)( void *arg ), void *arg );
 
 #endif
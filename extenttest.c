@@ -0,0 +1,100 @@
+/*
+Check for extent lists that outgrow their allocation: formats with
+extents and writes every other block of one file, syncing in between
+so that each write appends a hole and a new extent rather than
+extending the last one.  The list is grown a block at a time well past
+its starting capacity, then the file is read back before and after a
+remount, checking the data, the holes and fs_getsize.  Exits 1 on any
+mismatch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "disk.h"
+
+#define IMAGEBLOCKS 20000
+#define BLOCKS      1000	//written blocks, each with a hole after it but the last
+#define BLOCKSIZE   4096
+
+static char buf[BLOCKSIZE], out[BLOCKSIZE];
+static int failed = 0;
+
+/* Block i of the file holds i in every byte but the first, which is not zero. */
+
+static void fill( char *data, int i )
+{
+	memset(data,i,BLOCKSIZE);
+	data[0] = 1;
+}
+
+static void verify( int inumber, const char *when )
+{
+	int i, j, n;
+
+	if(fs_getsize(inumber)!=(int64_t)(2*BLOCKS-1)*BLOCKSIZE) {
+		printf("extenttest: size %lld %s, expected %lld\n",(long long)fs_getsize(inumber),when,
+			(long long)(2*BLOCKS-1)*BLOCKSIZE);
+		failed++;
+	}
+	for(i=0;i<2*BLOCKS-1;i++) {
+		n = fs_read(inumber,out,BLOCKSIZE,(int64_t)i*BLOCKSIZE);
+		if(i%2) {
+			for(j=0;j<n && !out[j];j++);
+			if(n!=BLOCKSIZE || j<n) {
+				printf("extenttest: hole at block %d %s doesn't read back as zeros\n",i,when);
+				failed++;
+			}
+		} else {
+			fill(buf,i/2);
+			if(n!=BLOCKSIZE || memcmp(buf,out,BLOCKSIZE)) {
+				printf("extenttest: block %d %s reads back wrong\n",i,when);
+				failed++;
+			}
+		}
+	}
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *image = argc>1 ? argv[1] : "extenttest.img";
+	int inumber, i;
+
+	if(!disk_init(image,IMAGEBLOCKS)) {
+		printf("extenttest: couldn't open %s\n",image);
+		return 1;
+	}
+	if(!fs_format_opts(FS_FORMAT_EXTENTS) || !fs_mount()) {
+		printf("extenttest: couldn't format %s\n",image);
+		return 1;
+	}
+
+	inumber = fs_create();
+	for(i=0;i<BLOCKS;i++) {
+		fill(buf,i);
+		if(fs_write(inumber,buf,BLOCKSIZE,(int64_t)2*i*BLOCKSIZE)!=BLOCKSIZE) {
+			printf("extenttest: write of block %d failed\n",2*i);
+			return 1;
+		}
+		fs_sync();
+	}
+	verify(inumber,"before remount");
+
+	fs_unmount();
+	if(!fs_mount()) {
+		printf("extenttest: couldn't remount %s\n",image);
+		return 1;
+	}
+	verify(inumber,"after remount");
+	fs_unmount();
+
+	disk_close();
+	unlink(image);
+
+	printf("extenttest: %s\n",failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -1,625 +1,3771 @@
+#define _GNU_SOURCE
+
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <math.h>
-
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#include <limits.h>
+#include <pthread.h>
+
+#define FS_MAGIC           0xf0f03410	//original layout, superblock has no revision fields
+#define FS_MAGIC_REV       0xf0f03411	//superblock carries features and state
+#define FS_FEATURE_BLOCKMAP 0x1	//free block bitmap stored after the inode table
+#define FS_FEATURE_INODEMAP 0x2	//free inode bitmap stored after the block bitmap
+#define FS_FEATURE_EXTENTS  0x4	//files are mapped by extents instead of block pointers
+#define FS_FEATURE_BIGFILE  0x8	//64-byte inodes with double and triple indirect blocks
+#define FS_FEATURE_LARGEFILE 0x10	//file sizes are 64 bits, upper half in sizehi
+#define FS_FEATURE_LAZYINIT 0x20	//inode blocks past inodeinit were never written
+#define FS_FEATURE_INLINEDATA 0x40	//256-byte inodes, small files kept inside them
+#define FS_FEATURE_REFCOUNT 0x80	//per-block owner counts stored after the inode map
+#define FS_STATE_CLEAN     0x1	//set by fs_unmount, cleared while mounted
+#define INODES_PER_BLOCK   128	//with the original 32-byte inode records
+#define INODE_SIZE_SMALL   32
+#define INODE_SIZE_LARGE   64
+#define INODE_SIZE_INLINE  256
+#define INODE_INLINE_MAX   (INODE_SIZE_INLINE - INODE_SIZE_LARGE)
+#define INODE_FLAG_INLINE  0x1	//file data is in the inode, no blocks mapped
+#define INODE_FLAG_DIR     0x2	//file holds a hashed directory
+#define DIR_MAGIC          0x64697231	//first word of a directory
+#define DIR_REMOVED        -1	//inumber left in an unlinked entry's slot
+#define DIRENTS_PER_BLOCK  64	//64-byte directory entries
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define EXTENTS_PER_INODE  2
+#define EXTENTS_PER_BLOCK  511
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE * 8)
+#define WORDS_PER_BLOCK    (DISK_BLOCK_SIZE / 8)
+#define INODE_CACHE_SIZE   256
+#define READAHEAD_MIN      8	//blocks, window opened by the second sequential read
+#define READAHEAD_MAX      256
+#define READ_BATCH         64	//whole blocks handed to the cache at once by fs_read
+#define SCAN_CHUNK         128	//inode blocks prefetched at a time by the mount scan
+#define DELALLOC_MAX       1024	//blocks of unallocated file data held in memory
+#define COPY_RUN           1024	//blocks moved in one host file transfer at most
+#define INIT_CHUNK         64	//inode blocks zeroed at a time past the lazy init mark
+#define REFS_PER_BLOCK     (DISK_BLOCK_SIZE / 2)	//16-bit counts
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	//only meaningful when magic is FS_MAGIC_REV
+	int features;
+	int state;
+	int nbitmapblocks;
+	int ninodemapblocks;
+	int inodesize;	//0 means INODE_SIZE_SMALL
+	int inodeinit;	//inode blocks written so far, with FS_FEATURE_LAZYINIT
+	int nrefblocks;	//with FS_FEATURE_REFCOUNT
+	int nshared;	//sum of the counts, as of the last unmount
+};
+
+struct fs_extent {
+	int start;	//first block of the run, 0 for a hole
+	int length;	//in blocks
 };
 
 struct fs_inode {
 	int isvalid;
 	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+		};
+		//same space, used when FS_FEATURE_EXTENTS is set
+		struct {
+			struct fs_extent extent[EXTENTS_PER_INODE];
+			int nextents;
+			int overflow;	//first block of the overflow chain
+		};
+	};
+	//the rest only exists in INODE_SIZE_LARGE records
+	int dindirect;
+	int tindirect;
+	int sizehi;
+	int flags;
+	int reserved[4];
+	//only in INODE_SIZE_INLINE records
+	char data[INODE_INLINE_MAX];
+};
+
+//extents past the ones that fit in the inode, chained through next
+struct fs_extent_block {
+	int next;
+	int count;
+	struct fs_extent extent[EXTENTS_PER_BLOCK];
+};
+
+//a directory's first block holds this header, followed by nbuckets
+//blocks of entries.  an entry goes in the block its name hashes to,
+//or when that is full the next one with room, wrapping around
+struct fs_dirhead {
+	int magic;
+	int nbuckets;	//a power of two
+	int count;	//live entries
+	int removed;	//slots left DIR_REMOVED by unlink
+};
+
+struct fs_dirent {
+	int inumber;	//0 for a slot never used
+	unsigned hash;
+	char name[FS_NAME_MAX + 1];
 };
 
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_extent_block extents;
+	struct fs_dirent dirents[DIRENTS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
-int *fbb = NULL;
-//free block bitmap, 
-//fbb[block] = 1  => block is in use
-//fbb[block] = 0  => block is free
-int nblocks, ninodes, ninodeblocks;
-int mounted = 0;
+//in-memory extent, with the logical position worked out on load
+struct extent {
+	int lblock;
+	int start;
+	int length;
+};
+
+struct fs_map {
+	struct bitmap bits;
+	char *dirty;	//one flag per on-disk block that no longer matches bits
+	int start;	//first block of the on-disk copy
+	int nblocks;	//0 when the map only lives in memory
+};
+
+//how many owners each block has beyond the one its bitmap bit stands
+//for, so clones can share data.  A table block is read the first time
+//a count in it is needed
+struct fs_refs {
+	uint16_t **counts;	//one array per table block, NULL until read
+	char *dirty;
+	int start;
+	int nblocks;
+};
+
+//one pointer block on a cached path through a double or triple
+//indirect tree
+struct indlevel {
+	int blocknum;	//0 when nothing is loaded
+	int *ptrs;
+	int dirty;
+};
+
+//file data written to a hole, waiting for a block to be chosen
+struct pending {
+	int lblock;
+	char *data;
+};
+
+struct inode_entry {
+	struct fs *fs;
+	int inumber;	//-1 when the slot is empty
+	int dirty;	//inode differs from the copy in its inode block
+	int referenced;
+	int users;	//callers between inodeGet and inodePut, never evicted
+	pthread_rwlock_t lock;
+	pthread_mutex_t maplock;
+	struct fs_inode inode;
+	int *indirect;	//pinned copy of the indirect block, NULL until needed
+	int indirectdirty;
+	struct extent *ext;	//pinned extent list, NULL until needed
+	int nextents;
+	int extcap;
+	int exthint;	//extent the last lookup landed in
+	int extdirty;
+	int *overflow;	//blocks of the on-disk overflow chain
+	int noverflow;
+	struct indlevel dpath[2];	//last path walked under dindirect
+	struct indlevel tpath[3];	//last path walked under tindirect
+	int64_t raoff;	//offset a sequential reader would ask for next
+	int rawindow;	//blocks to keep read ahead, 0 while access looks random
+	int ranext;	//first logical block not prefetched yet
+	struct pending *pend;	//sorted by lblock
+	int npend;
+	int pendcap;
+	struct inode_entry *next;
+};
+
+//one mounted image.  Everything the filesystem keeps between calls
+//lives here, so any number can be open at once; the calls without an
+//fs argument work on a default instance over the disk_init image.
+//
+//locking, always taken in this order:
+//fslock     held for writing by format, mount, unmount, sync and debug,
+//           for reading by every per-file call
+//entry lock per cached inode, readers share it, writers, create and
+//           delete hold it alone
+//           a call holds one entry at a time, so inodeGet can wait
+//           for a slot when every one is in use
+//maplock    per cached inode, guards the mapping caches and read-ahead
+//           state that readers fill in as they go
+//icachelock the inode cache slots, hash chains, inode block updates and
+//           the lazy init mark
+//alloclock  both allocation maps, the block reference counts and the
+//           count of buffered blocks
+struct fs {
+	struct disk *disk;	//NULL for the default instance, which follows disk_init
+	struct cache *cache;
+	struct fs_map fbb;
+	//free block bitmap, one bit per block
+	//bit set   => block is in use
+	//bit clear => block is free
+	struct fs_map fib;
+	//free inode bitmap, same convention, inumber 0 is always set
+	struct fs_refs refs;
+	int nshared;	//extra owners over all blocks, while 0 no count is looked up
+	int nblocks, ninodes, ninodeblocks, nbitmapblocks, ninodemapblocks, nrefblocks;
+	int inodesize, inodesperblock;
+	int inodeinit;	//inode blocks 1..inodeinit are on disk, the rest read as free
+	int features;
+	int mounted;
+	pthread_rwlock_t fslock;
+	pthread_mutex_t icachelock;
+	pthread_cond_t islotfree;	//an inode cache slot's last user put it back
+	pthread_mutex_t alloclock;
+	struct inode_entry icache[INODE_CACHE_SIZE];
+	struct inode_entry *ibuckets[INODE_CACHE_SIZE];
+	int ihand;
+	int npending;	//pending blocks across all inodes
+	struct fs_stats stats;
+};
+
 int blocksize = 4096;
 
-int blockToInode(int blocknum, int inodenum)
+int blockToInode(struct fs *fs, int blocknum, int inodenum)
 {
-	return ((blocknum -1) * INODES_PER_BLOCK) + inodenum + 1;
+	return ((blocknum -1) * fs->inodesperblock) + inodenum;
 }
 
-int fs_format()
+//inode records are inodesize bytes, a prefix of struct fs_inode
+void inodeDecode(struct fs *fs, const union fs_block *block, int slot, struct fs_inode *in)
 {
-	//if(fs_mount())	//do not run on already mounted disk
-	if (mounted)	
-		return 0;
+	memset(in, 0, sizeof(*in));
+	memcpy(in, block->data + slot * fs->inodesize, fs->inodesize);
+}
 
-	int nblocks = disk_size();
-	printf("nblocks is %d\n", nblocks);
-	int ninodeblocks = (nblocks + 9)/10;
-	//this unusual division is to ensure rounding up
-	//for some bizarre reason, the ceil function was acting up
-	printf("ninodeblocks is %d\n", ninodeblocks);
-	
-	union fs_block block;
-	//set superblock data
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = nblocks;
-	block.super.ninodeblocks = ninodeblocks;
-	block.super.ninodes = ninodeblocks * INODES_PER_BLOCK;
-	disk_write(0, block.data);  //write superblock to disk
+void inodeEncode(struct fs *fs, union fs_block *block, int slot, const struct fs_inode *in)
+{
+	memcpy(block->data + slot * fs->inodesize, in, fs->inodesize);
+}
 
-	//clear out inodes, write to disk
-	int i, j, k;
-	//start at 1, 0 is superblock above
-	for (i = 1; i <= ninodeblocks; i++)
-	{
-		for (k = 0; k < INODES_PER_BLOCK; k++)
-		{
-			block.inode[k].isvalid = 0;
-			block.inode[k].size = 0;
-			block.inode[k].indirect = 0;
-			for(j = 0; j < POINTERS_PER_INODE; j++)
-				block.inode[k].direct[j] = 0;
+int64_t inodeSize(const struct fs_inode *in)
+{
+	return ((int64_t) in->sizehi << 32) | (uint32_t) in->size;
+}
 
-		}
-		disk_write(i, block.data);
-	}
+void inodeSetSize(struct fs_inode *in, int64_t size)
+{
+	in->size = (uint32_t) size;
+	in->sizehi = size >> 32;
+}
 
-	return 1;
+//largest file the mounted layout can describe
+int64_t maxFileSize(struct fs *fs)
+{
+	int64_t max;
+
+	if(fs->features & FS_FEATURE_EXTENTS)
+		max = (int64_t) INT_MAX * DISK_BLOCK_SIZE;
+	else if(fs->features & FS_FEATURE_BIGFILE)
+		max = (POINTERS_PER_INODE + POINTERS_PER_BLOCK +
+			(int64_t) POINTERS_PER_BLOCK * POINTERS_PER_BLOCK +
+			(int64_t) POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE;
+	else
+		max = (int64_t) (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE;
+	if(!(fs->features & FS_FEATURE_LARGEFILE) && max > INT_MAX)
+		max = INT_MAX;
+	return max;
 }
 
-void fs_debug()
+//bytes a file can hold inside its inode
+int inlineMax(struct fs *fs)
 {
-	union fs_block block, idblock;
-	//struct fs_inode inode;
+	return (fs->features & FS_FEATURE_INLINEDATA) ? fs->inodesize - INODE_SIZE_LARGE : 0;
+}
 
-	disk_read(0,block.data);
+int mapInit(struct fs_map *map, int nbits, int start, int nmapblocks)
+{
+	bitmap_free(&map->bits);
+	free(map->dirty);
+	map->start = start;
+	map->nblocks = nmapblocks;
+	map->dirty = calloc(nmapblocks + 1, 1);
+	return map->dirty && bitmap_init(&map->bits, nbits);
+}
 
-	printf("superblock:\n");
-	printf("    %d blocks\n",block.super.nblocks);
-	printf("    %d inode blocks\n",block.super.ninodeblocks);
-	printf("    %d inodes\n",block.super.ninodes);
+//only the map blocks holding the first nbits bits are read, the rest
+//are left clear
+void mapLoad(struct fs *fs, struct fs_map *map, int nbits)
+{
+	union fs_block block;
+	int n, words;
+	int nload = (int) (((int64_t) nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK);
 
-	int n = 0, nblocks = block.super.nblocks;
-	//int ninodes = block.super.ninodes;
-	int ninodeblocks = block.super.ninodeblocks;
+	if(nload > map->nblocks)
+		nload = map->nblocks;
+	cache_prefetch_r(fs->cache, map->start, nload);
+	for(n = 0; n < nload; n++)
+	{
+		cache_read_r(fs->cache, map->start + n, block.data);
+		words = map->bits.nwords - n * WORDS_PER_BLOCK;
+		if(words > WORDS_PER_BLOCK)
+			words = WORDS_PER_BLOCK;
+		memcpy(map->bits.words + n * WORDS_PER_BLOCK, block.data, words * sizeof(uint64_t));
+	}
+	bitmap_recount(&map->bits);
+}
 
-	//printf("num blocks is %d\n", nblocks);
-	
-	//maybe also read the indirect block to get the data
-		//that it points to
-	int i, j, k;
-	for (n = 1; n <= ninodeblocks; n++)	//start at 1, 0 is done above
+//push map blocks changed since the last flush into the cache
+void mapFlush(struct fs *fs, struct fs_map *map)
+{
+	union fs_block block;
+	int n, words, first, last;
+
+	for(first = 0; first < map->nblocks && !map->dirty[first]; first++);
+	for(last = map->nblocks; last > first && !map->dirty[last - 1]; last--);
+	cache_prefetch_r(fs->cache, map->start + first, last - first);
+	for(n = first; n < last; n++)
 	{
-		disk_read(n, block.data); 
-		//printf("block: %d\n", n);
+		if(!map->dirty[n]) continue;
+		words = map->bits.nwords - n * WORDS_PER_BLOCK;
+		if(words > WORDS_PER_BLOCK)
+			words = WORDS_PER_BLOCK;
+		memset(block.data, 0, DISK_BLOCK_SIZE);
+		memcpy(block.data, map->bits.words + n * WORDS_PER_BLOCK, words * sizeof(uint64_t));
+		cache_write_r(fs->cache, map->start + n, block.data);
+		map->dirty[n] = 0;
+	}
+}
 
-		for (i = 0; i < INODES_PER_BLOCK; i++) 
-		{
-			//skip if inode is empty or invalid
-			//if (block.inode[i].size == 0) continue;
-			if(block.inode[i].isvalid == 0) continue;
+void mapDirty(struct fs_map *map, int bit)
+{
+	if(map->nblocks)
+		map->dirty[bit / BITS_PER_BLOCK] = 1;
+}
 
-			printf("inode %d:\n", blockToInode(n, i));
-			printf("    size: %d bytes\n", block.inode[i].size);
-			printf("    direct blocks: ");
+void mapDirtyAll(struct fs_map *map)
+{
+	memset(map->dirty, 1, map->nblocks);
+}
 
-			for (j = 0; j < POINTERS_PER_INODE; j++) 
-			{
-				if (block.inode[i].direct[j] != 0)
-					printf("%d ", block.inode[i].direct[j]);
-			}
-			printf("\n");
-			if (block.inode[i].indirect != 0)
-			{
-				printf("    indirect block: %d\n", block.inode[i].indirect);
-				printf("    indirect data blocks: ");
-				disk_read(block.inode[i].indirect, idblock.data);
-				for(k=0; k < POINTERS_PER_BLOCK; k++)
-				{
-					if(idblock.pointers[k] > 0 && idblock.pointers[k] < nblocks)
-					{
-						printf("%d ", idblock.pointers[k]);
-					}
-				}
-				printf("\n");
-			}
-				
-		}
-	}
+void mapSet(struct fs_map *map, int bit)
+{
+	bitmap_set(&map->bits, bit);
+	mapDirty(map, bit);
 }
 
-int fs_mount()
+void mapClear(struct fs_map *map, int bit)
 {
-	union fs_block block;
-	disk_read(0, block.data);
-	//filesystem is not present
-	if (block.super.magic != FS_MAGIC)
-		return 0;
+	bitmap_clear(&map->bits, bit);
+	mapDirty(map, bit);
+}
 
+int mapAlloc(struct fs_map *map)
+{
+	int bit = bitmap_alloc(&map->bits);
+	if(bit != -1)
+		mapDirty(map, bit);
+	return bit;
+}
+
+void refFree(struct fs_refs *refs)
+{
 	int n;
-	int *temp = (int*) realloc (fbb, block.super.nblocks);
-	ninodeblocks = block.super.ninodeblocks;
-	nblocks = block.super.nblocks;
-	ninodes = block.super.ninodes;
-	if (temp != NULL)
-	{
-		fbb = temp;
-		fbb[0] = 1; //superblock is in use
-		for(n = 1; n <= ninodeblocks; n++)
-			fbb[n] = 1; 	//inode blocks are in use
-		for(n = n; n < block.super.nblocks; n++)
-			fbb[n] = 0;		//mark data blocks as unused to start 
-	}
-	else return 0;	//something failed 
-	
-	int i, j, k;
-	for (i = 1; i <= ninodeblocks; i++)
-	{
-		disk_read(i, block.data);
-		for (j = 0; j < INODES_PER_BLOCK; j++)
-		{		
-			if (block.inode[j].isvalid == 0) continue;
-			if (block.inode[j].indirect != 0)
-				fbb[block.inode[j].indirect] = 1;
 
-			for (k = 0; k < POINTERS_PER_INODE; k++)
-			{
-				if(block.inode[j].direct[k] != 0)
-					fbb[block.inode[j].direct[k]] = 1;
-			}
-		
-		}
-	}
+	for(n = 0; refs->counts && n < refs->nblocks; n++)
+		free(refs->counts[n]);
+	free(refs->counts);
+	free(refs->dirty);
+	refs->counts = NULL;
+	refs->dirty = NULL;
+	refs->nblocks = 0;
+}
+
+int refInit(struct fs_refs *refs, int start, int nrefblocks)
+{
+	refFree(refs);
+	refs->start = start;
+	refs->nblocks = nrefblocks;
+	refs->counts = calloc(nrefblocks + 1, sizeof(uint16_t *));
+	refs->dirty = calloc(nrefblocks + 1, 1);
+	return refs->counts && refs->dirty;
+}
+
+//counts in the table block covering block b, read on first use.
+//caller holds alloclock
+uint16_t *refBlock(struct fs *fs, int b)
+{
+	struct fs_refs *refs = &fs->refs;
+	int n = b / REFS_PER_BLOCK;
 
-	//this will hopefully set all indirect pointers to 0
-	for(i=ninodeblocks+1; i<nblocks; i++)
+	if(b < 0 || n >= refs->nblocks)
+		return NULL;
+	if(!refs->counts[n])
 	{
-		disk_read(i, block.data);
-		for(j=0; j<POINTERS_PER_BLOCK; j++)
-		{
-			block.pointers[j] = 0;
-		}
-			
+		refs->counts[n] = malloc(DISK_BLOCK_SIZE);
+		if(!refs->counts[n])
+			return NULL;
+		cache_read_r(fs->cache, refs->start + n, (char *) refs->counts[n]);
 	}
-	
-	mounted = 1;
+	return refs->counts[n];
+}
 
-	printf("free block bitmap is as follows:\n");
-	for(i=0; i <nblocks; i++)
-		printf("%d ", fbb[i]);
+//owners of block b besides the first, caller holds alloclock
+int refGet(struct fs *fs, int b)
+{
+	uint16_t *counts;
 
-	printf("\n");
-	return 1;
+	if(!fs->nshared || !(counts = refBlock(fs, b)))
+		return 0;
+	return counts[b % REFS_PER_BLOCK];
 }
 
-int fs_create()
+//change block b's count by delta; 0 when it would go out of range.
+//caller holds alloclock
+int refAdd(struct fs *fs, int b, int delta)
 {
-	if(!mounted)
-	{
-		printf("Error: disk not mounted.  Run mount first\n");
+	uint16_t *counts = refBlock(fs, b);
+	int n;
+
+	if(!counts)
 		return 0;
-	}
+	n = counts[b % REFS_PER_BLOCK] + delta;
+	if(n < 0 || n > UINT16_MAX)
+		return 0;
+	counts[b % REFS_PER_BLOCK] = n;
+	fs->refs.dirty[b / REFS_PER_BLOCK] = 1;
+	__atomic_fetch_add(&fs->nshared, delta, __ATOMIC_RELAXED);
+	return 1;
+}
 
-	union fs_block block;
-	int blocknum = 1; //, inode = 0;
-	disk_read(0, block.data);
-	printf("\n\n");
-	printf("Disk has been read.\n");
-	int inodeblocks = block.super.ninodeblocks + 1;
-	printf("Number of inodeblocks is %d.\n", inodeblocks);
-	while (blocknum != inodeblocks){
-		printf("Number of blocknum %d.\n", blocknum);
-		disk_read(blocknum, block.data);
-		int i = 0;
-		for (i = 0; i < INODES_PER_BLOCK; i++){
-			printf("We are on inode %d \n", i);
-			if (!block.inode[i].isvalid){
-				printf("Number of blocknum again is %d.\n", blocknum);
-				int inumber = ((blocknum -1) * INODES_PER_BLOCK) + i + 1;
-				block.inode[i].size = 0;
-				memset(block.inode[i].direct, 0, sizeof block.inode[i].direct);
-				block.inode[i].isvalid = 1;
-				block.inode[i].indirect = 0;
-				printf("Inode %d is not valid and thus free.\n", i);
-				printf("inumber is %d.\n", inumber);
-				disk_write(blocknum, block.data);
-				return inumber;
-			}
-		}
-		blocknum++;
-	}
+//whether block b has another owner, so must be copied before writing
+int refShared(struct fs *fs, int b)
+{
+	int shared;
 
-	return 0;
+	if(!__atomic_load_n(&fs->nshared, __ATOMIC_RELAXED))
+		return 0;
+	pthread_mutex_lock(&fs->alloclock);
+	shared = refGet(fs, b) > 0;
+	pthread_mutex_unlock(&fs->alloclock);
+	return shared;
 }
 
-int fs_delete( int inumber )
+//give each block of a run one more owner, all or none of them
+int refShare(struct fs *fs, int start, int length)
 {
-	if(!mounted)
+	int b;
+
+	pthread_mutex_lock(&fs->alloclock);
+	for(b = start; b < start + length && refAdd(fs, b, 1); b++);
+	if(b < start + length)
 	{
-		printf("Error: disk not mounted.  Run mount first\n");
-		return 0;
+		while(b-- > start)
+			refAdd(fs, b, -1);
 	}
+	pthread_mutex_unlock(&fs->alloclock);
+	return b == start + length;
+}
 
-	union fs_block block, indirectblock;
-	//disk_read(0, block.data);
+//drop one owner of a shared block, 0 when block b isn't shared and the
+//caller was its only owner
+int refDrop(struct fs *fs, int b)
+{
+	int dropped;
 
-	//add 1 b/c 0 is superblock, inodes start at 1
-	int blocknum = inumber/INODES_PER_BLOCK + 1;
-	int inode = inumber % INODES_PER_BLOCK;
+	if(!__atomic_load_n(&fs->nshared, __ATOMIC_RELAXED))
+		return 0;
+	pthread_mutex_lock(&fs->alloclock);
+	dropped = refGet(fs, b) > 0 && refAdd(fs, b, -1);
+	pthread_mutex_unlock(&fs->alloclock);
+	return dropped;
+}
 
-	disk_read(blocknum, block.data);
-	int i;
+//start every count over at zero, for a rebuild
+int refReset(struct fs *fs)
+{
+	struct fs_refs *refs = &fs->refs;
+	int n;
 
-	//do not run if inode is invalid
-	if(block.inode[inode].isvalid == 0)
+	for(n = 0; n < refs->nblocks; n++)
 	{
-		printf("Error: inode is invalid\n");
-		return 0;
+		if(!refs->counts[n] && !(refs->counts[n] = malloc(DISK_BLOCK_SIZE)))
+			return 0;
+		memset(refs->counts[n], 0, DISK_BLOCK_SIZE);
+		refs->dirty[n] = 1;
 	}
+	fs->nshared = 0;
+	return 1;
+}
 
-	for(i=0; i<POINTERS_PER_INODE; i++)
-	{
-		fbb[block.inode[inode].direct[i]] = 0;
-		//mark this block as free
-	}
+void refFlush(struct fs *fs)
+{
+	struct fs_refs *refs = &fs->refs;
+	int n;
 
-	//if this inode used indirect block, we need to clear it
-	if(block.inode[inode].indirect != 0)
+	for(n = 0; n < refs->nblocks; n++)
 	{
-		disk_read(block.inode[inode].indirect, indirectblock.data);
-		for(i=0; i < POINTERS_PER_BLOCK; i++)
-		{
-			printf("i is this %d\n",i);
-			printf("the indirect pointer is this %d\n", indirectblock.pointers[i]);
-			if(indirectblock.pointers[i] > 0+ninodeblocks && indirectblock.pointers[i] < nblocks)
-			{
-				//only clear it if it was a valid pointer
-				//don't worry about garbage values
-				fbb[indirectblock.pointers[i]] = 0;
-			}
-			printf("the indirect pointer is this %d\n", indirectblock.pointers[i]);
-		}
-		disk_write(block.inode[inode].indirect, indirectblock.data);
+		if(!refs->dirty[n]) continue;
+		cache_write_r(fs->cache, refs->start + n, (char *) refs->counts[n]);
+		refs->dirty[n] = 0;
 	}
+}
 
-	//all the blocks are freed, mark this inode as invalid
-	printf("marking number %d as invalid\n", inode);
-	block.inode[inode].isvalid = 0;
-	disk_write(blocknum, block.data);
+void flushBitmap(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->alloclock);
+	mapFlush(fs, &fs->fbb);
+	mapFlush(fs, &fs->fib);
+	refFlush(fs);
+	pthread_mutex_unlock(&fs->alloclock);
+}
 
+int getFreeBlock(struct fs *fs) {
+	//returns -1 when there are no free blocks
+	pthread_mutex_lock(&fs->alloclock);
+	int blocknum = mapAlloc(&fs->fbb);
+	pthread_mutex_unlock(&fs->alloclock);
+	trace(TRACE_ALLOC, TRACE_DEBUG, "allocated block %d", blocknum);
+	return blocknum;
+}
 
-	/*
-	disk_read(block.inode[inode].indirect, indirectblock.data);
-	fbb[block.inode[inode].indirect] = 0;
-	//free indirect block itself
-	
-	//mark all the blocks it pointed to as free
-	for(i = 0; i < POINTERS_PER_BLOCK; i++)
+//take goal if it is free so files stay contiguous, else any block
+int getFreeBlockNear(struct fs *fs, int goal) {
+	pthread_mutex_lock(&fs->alloclock);
+	int blocknum = -1;
+	if(goal > 0 && goal < fs->nblocks && bitmap_take(&fs->fbb.bits, goal))
 	{
-		fbb[indirectblock.pointers[i]] = 0;
+		mapDirty(&fs->fbb, goal);
+		blocknum = goal;
 	}
-	*/
+	else
+		blocknum = mapAlloc(&fs->fbb);
+	pthread_mutex_unlock(&fs->alloclock);
+	trace(TRACE_ALLOC, TRACE_DEBUG, "allocated block %d, goal %d", blocknum, goal);
+	return blocknum;
+}
 
-	return 1;
+//a block shared with a clone only loses an owner
+void freeBlock(struct fs *fs, int blocknum) {
+	trace(TRACE_ALLOC, TRACE_DEBUG, "freed block %d", blocknum);
+	pthread_mutex_lock(&fs->alloclock);
+	if(!(refGet(fs, blocknum) > 0 && refAdd(fs, blocknum, -1)))
+		mapClear(&fs->fbb, blocknum);
+	pthread_mutex_unlock(&fs->alloclock);
+}
+
+//blocks freed by a delete, gathered into runs that go back to the
+//host in one discard each
+struct free_run {
+	int start;
+	int length;
+};
+
+//the bits are cleared only after the discard, so a block can't be
+//handed out again and have its new contents punched away
+void freeRunFlush(struct fs *fs, struct free_run *run)
+{
+	int b;
+
+	if (!run->length)
+		return;
+	trace(TRACE_ALLOC, TRACE_DEBUG, "freed blocks %d to %d", run->start, run->start + run->length - 1);
+	cache_discard_r(fs->cache, run->start, run->length);
+	pthread_mutex_lock(&fs->alloclock);
+	for (b = run->start; b < run->start + run->length; b++)
+		mapClear(&fs->fbb, b);
+	pthread_mutex_unlock(&fs->alloclock);
+	run->length = 0;
 }
 
-int fs_getsize( int inumber )
+//blocks still shared with a clone stay where they are
+void freeRunAdd(struct fs *fs, struct free_run *run, int blocknum)
 {
-	if(!mounted)
+	if (refDrop(fs, blocknum))
+		return;
+	if (run->length && blocknum == run->start + run->length)
 	{
-		printf("Error: disk not mounted.  Run mount first\n");
-		return -1;
+		run->length++;
+		return;
 	}
+	freeRunFlush(fs, run);
+	run->start = blocknum;
+	run->length = 1;
+}
 
-	union fs_block block;
-	//struct fs_inode inode;
-
-	disk_read(0,block.data);
-
-	int blocknum = inumber/INODES_PER_BLOCK + 1;
-	int inode = inumber % INODES_PER_BLOCK;// % inumber;
-	
-	disk_read(blocknum, block.data);
-	printf("Size: \n");
-	printf("    %d bytes\n", block.inode[inode].size);
-	return block.inode[inode].size;
-
-	//maybe also read the indirect block to get the data
-		//that it points to
+int extentStore(struct inode_entry *e);
+int fileMapBlock(struct inode_entry *e, int b, int *fresh);
+int inodeSpill(struct inode_entry *e);
+void inodePut(struct inode_entry *e);
 
-	
-	return -1;
+//whether a whole block of data is all zeros, and can stay a hole
+int zeroBlock(const char *data)
+{
+	return data[0] == 0 && memcmp(data, data + 1, DISK_BLOCK_SIZE - 1) == 0;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+//index of the pending entry for logical block b, or where it would go
+int pendSearch(struct inode_entry *e, int b)
 {
-	//printf("attempting read\n");
-	if(!mounted)
+	int lo = 0, hi = e->npend;
+	while(lo < hi)
 	{
-		printf("Error: disk not mounted.  Run mount first\n");
-		return 0;
+		int mid = (lo + hi) / 2;
+		if(e->pend[mid].lblock < b)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	union fs_block inodeblock, datablock, indirectblock;
-	int iblock = inumber / INODES_PER_BLOCK + 1;
-	int inode = inumber % INODES_PER_BLOCK - 1;
-	//printf("reading from block %d, array inode %d\n", iblock, inode);
-	//printf("corresponds to inode number %d\n", blockToInode(iblock, inode));
-	int i, blockremaining = blocksize;
-	disk_read(iblock, inodeblock.data);
-	//char *garbage;
-	int bytesread = 0;
+//buffered data for logical block b, NULL if it has none
+char *pendData(struct inode_entry *e, int b)
+{
+	int i = pendSearch(e, b);
+	if(i < e->npend && e->pend[i].lblock == b)
+		return e->pend[i].data;
+	return NULL;
+}
 
-	//printf("size: %d\n", inodeblock.inode[inode].size);
-	//printf("direct: %d\n", inodeblock.inode[inode].direct[0]);
+//buffer for logical block b, zeroed when new
+char *pendAdd(struct inode_entry *e, int b)
+{
+	struct fs *fs = e->fs;
+	int i = pendSearch(e, b);
+	if(i < e->npend && e->pend[i].lblock == b)
+		return e->pend[i].data;
 
-	//initialize an array that could contain every block we need
-	int blockArray[POINTERS_PER_INODE + POINTERS_PER_BLOCK] = {0};
-	
-	//maybe we can take all the possible blocks
-	//and put them into an array to save some code reuse
-	for(i=0; i < POINTERS_PER_INODE; i++)
+	if(e->npend == e->pendcap)
 	{
-		blockArray[i] = inodeblock.inode[inode].direct[i];
-		printf("added %d to the array\n", blockArray[i]);
-		//load direct blocks into the array
+		int cap = e->pendcap ? e->pendcap * 2 : 16;
+		struct pending *p = realloc(e->pend, cap * sizeof(struct pending));
+		if(!p)
+			return NULL;
+		e->pend = p;
+		e->pendcap = cap;
 	}
+	char *data = calloc(1, DISK_BLOCK_SIZE);
+	if(!data)
+		return NULL;
+	memmove(&e->pend[i + 1], &e->pend[i], (e->npend - i) * sizeof(struct pending));
+	e->pend[i].lblock = b;
+	e->pend[i].data = data;
+	e->npend++;
+	pthread_mutex_lock(&fs->alloclock);
+	fs->npending++;
+	pthread_mutex_unlock(&fs->alloclock);
+	return data;
+}
 
-	disk_read(inodeblock.inode[inode].indirect, indirectblock.data);
-	for(i=POINTERS_PER_INODE; i < POINTERS_PER_BLOCK; i++)
-	{
-		blockArray[i] = indirectblock.pointers[i-POINTERS_PER_INODE];
-	}
-	
-	//check through array of block pointers
-	for(i=0; i < POINTERS_PER_INODE + POINTERS_PER_BLOCK; i++)
-	{
-		//printf("entered for loop %d\n", blockArray[i]);
-		if(blockArray[i] <= 0) continue;
-		if(blockArray[i] >=nblocks) continue;
-		if(i >= nblocks) return bytesread;
+//forget the first n buffered blocks, once they are written or the
+//file is gone
+void pendForget(struct inode_entry *e, int n)
+{
+	struct fs *fs = e->fs;
+	int i;
+	if(!n)
+		return;
+	for(i = 0; i < n; i++)
+		free(e->pend[i].data);
+	memmove(e->pend, e->pend + n, (e->npend - n) * sizeof(struct pending));
+	e->npend -= n;
+	pthread_mutex_lock(&fs->alloclock);
+	fs->npending -= n;
+	pthread_mutex_unlock(&fs->alloclock);
+}
+
+void pendDrop(struct inode_entry *e)
+{
+	pendForget(e, e->npend);
+	free(e->pend);
+	e->pend = NULL;
+	e->npend = e->pendcap = 0;
+}
+
+//choose blocks for the buffered data and write it out.  Allocating in
+//logical order lets fileMapBlock lay the file out as one run, and the
+//whole lot goes to the disk as a single vectored write.  fs_write has
+//already reported the data written, so when the disk fills up the
+//blocks left over stay buffered for a later flush to retry, and 0 is
+//returned
+int pendFlush(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	struct disk_io *io;
+	int n, fresh;
 
-		disk_read(blockArray[i], datablock.data);
-		if(offset >= blocksize) 
+	io = malloc(e->npend * sizeof(struct disk_io));
+	for(n = 0; n < e->npend; n++)
+	{
+		int blocknum = fileMapBlock(e, e->pend[n].lblock, &fresh);
+		if(blocknum == -1)
 		{
-			offset -= blocksize;			
-			continue;
+			printf("Error: No free blocks found\n");
+			break;
 		}
-		else if(offset > 0) 
+		if(io)
 		{
-			blockremaining = blocksize - offset;
-			memcpy(data+offset, datablock.data, blockremaining);
-			offset -= offset;
-		}		
+			io[n].blocknum = blocknum;
+			io[n].data = e->pend[n].data;
+		}
+		else
+			cache_write_r(fs->cache, blocknum, e->pend[n].data);
+	}
+	if(io)
+	{
+		cache_writev_r(fs->cache, io, n);
+		free(io);
+	}
+	pendForget(e, n);
+	return e->npend == 0;
+}
 
-		blockremaining = blocksize;
-		if(offset <= 0)
-		{	//we're now past the offset
-			if(length == 0)
-			{
-				//printf("length is 0 returning\n");
-				return bytesread;
-			}
+//under memory pressure, every inode gives up its buffered data.  self
+//is the caller's inode, already locked for writing; others in use by
+//another thread are left to it.
+void pendFlushAll(struct inode_entry *self)
+{
+	struct fs *fs = self->fs;
+	struct inode_entry *busy[INODE_CACHE_SIZE];
+	int i, n = 0;
 
-			if(length > blockremaining)
-			{
-				//printf("length > remaining\n");
-				memcpy(data + bytesread, datablock.data + bytesread, blockremaining);
-				length -= blockremaining;
-				bytesread += blockremaining;
-			}
-			else if(length < blockremaining)
-			{
-				//this is the last part to copy
-				//printf("entering final copy\n");
-				memcpy(data + bytesread, datablock.data + bytesread, length);
-				bytesread += length;
-				return bytesread;
-			}
-			blockremaining = blocksize;
+	pthread_mutex_lock(&fs->icachelock);
+	for(i = 0; i < INODE_CACHE_SIZE; i++)
+	{
+		if(&fs->icache[i] != self && fs->icache[i].inumber != -1 && fs->icache[i].npend)
+		{
+			fs->icache[i].users++;
+			busy[n++] = &fs->icache[i];
 		}
-	
 	}
+	pthread_mutex_unlock(&fs->icachelock);
 
-	//now do indirect
-	/*disk_read(inodeblock.inode[inode].indirect, indirectblock.data);
-	for(i=0; i < POINTERS_PER_BLOCK; i++)
+	if(self->npend)
+		pendFlush(self);
+	for(i = 0; i < n; i++)
 	{
-		disk_read(indirectblock.pointers[i], datablock.data);
-		
-	}*/
-
-	//printf("returning 0\n");
-	return 0;
+		if(pthread_rwlock_trywrlock(&busy[i]->lock) == 0)
+		{
+			pendFlush(busy[i]);
+			pthread_rwlock_unlock(&busy[i]->lock);
+		}
+		inodePut(busy[i]);
+	}
 }
 
-int getFreeBlock() {
-	int i;
-	for(i=1; i < nblocks; i++)
-	{
-		if(fbb[i] == 0)
-			return i;
-	}
-	return -1;
-	//no free blocks
+//whether another block can be buffered and still be sure to find room
+//for it, and for the pointer or extent blocks it may need, at flush
+int pendRoom(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->alloclock);
+	int room = fs->npending < DELALLOC_MAX &&
+		fs->fbb.bits.nfree - fs->npending > fs->npending / 512 + 16;
+	pthread_mutex_unlock(&fs->alloclock);
+	return room;
 }
 
-int blockToWrite(int *offset, struct fs_inode inode)
+void levelFlush(struct fs *fs, struct indlevel *l)
 {
-	int counter;
-	while(*offset > blocksize)
+	if(l->dirty)
 	{
-		counter++;
-		*offset -= blocksize;
+		cache_write_r(fs->cache, l->blocknum, (char *) l->ptrs);
+		l->dirty = 0;
 	}
+}
 
-	if(counter < POINTERS_PER_INODE)
+void levelDrop(struct indlevel *l)
+{
+	free(l->ptrs);
+	l->ptrs = NULL;
+	l->blocknum = 0;
+	l->dirty = 0;
+}
+
+//make blocknum the block held at this level, reading it unless fresh
+//is set, in which case it starts out zeroed
+int *levelLoad(struct fs *fs, struct indlevel *l, int blocknum, int fresh)
+{
+	if(l->ptrs && l->blocknum == blocknum)
+		return l->ptrs;
+	levelFlush(fs, l);
+	if(!l->ptrs)
 	{
-		if(inode.direct[counter] != 0)
-			return inode.direct[counter];
-		else
-			return getFreeBlock();
+		l->ptrs = malloc(DISK_BLOCK_SIZE);
+		if(!l->ptrs)
+			return NULL;
 	}
-	else if(counter >= POINTERS_PER_INODE)
+	l->blocknum = blocknum;
+	if(fresh)
 	{
-		union fs_block block;
-		disk_read(inode.indirect, block.data);
-		if(block.pointers[counter-POINTERS_PER_INODE] != 0)
-			return block.pointers[counter-POINTERS_PER_INODE];
-		else
-			return getFreeBlock();
+		memset(l->ptrs, 0, DISK_BLOCK_SIZE);
+		l->dirty = 1;
 	}
-	return -1;
+	else
+		cache_read_r(fs->cache, blocknum, (char *) l->ptrs);
+	return l->ptrs;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+void inodeWriteBack(struct inode_entry *e)
 {
-	printf("Attempting write\n");
-	printf("%s", data);
-	if(!mounted)
+	struct fs *fs = e->fs;
+	union fs_block block;
+
+	//allocates blocks for the buffered data, so comes before the
+	//inode and the maps it changes are written
+	if(e->npend)
+		pendFlush(e);
+	//may allocate overflow blocks and change the inode, so goes first
+	if(e->extdirty)
+		extentStore(e);
+	if(e->dirty)
 	{
-		printf("Error: disk not mounted.  Run mount first\n");
-		return 0;
+		int blocknum = e->inumber / fs->inodesperblock + 1;
+		cache_read_r(fs->cache, blocknum, block.data);
+		inodeEncode(fs, &block, e->inumber % fs->inodesperblock, &e->inode);
+		cache_write_r(fs->cache, blocknum, block.data);
+		e->dirty = 0;
+	}
+	if(e->indirectdirty)
+	{
+		cache_write_r(fs->cache, e->inode.indirect, (char *) e->indirect);
+		e->indirectdirty = 0;
 	}
+	int i;
+	for(i = 0; i < 2; i++)
+		levelFlush(fs, &e->dpath[i]);
+	for(i = 0; i < 3; i++)
+		levelFlush(fs, &e->tpath[i]);
+}
 
-	union fs_block inodeblock, datablock, idblock;
-	int iblock = inumber / INODES_PER_BLOCK + 1;
-	int inode = inumber % INODES_PER_BLOCK -1;
-	int byteswritten = 0, blockremaining = 4096;
-	
-	disk_read(iblock, inodeblock.data);
-	printf("read inode block data\n");
+//forget the pinned indirect block and extent list without writing them
+void inodeDropMaps(struct inode_entry *e)
+{
+	free(e->indirect);
+	free(e->ext);
+	free(e->overflow);
+	e->indirect = NULL;
+	e->indirectdirty = 0;
+	e->ext = NULL;
+	e->nextents = e->extcap = e->exthint = 0;
+	e->extdirty = 0;
+	e->overflow = NULL;
+	e->noverflow = 0;
+	pendDrop(e);
+	int i;
+	for(i = 0; i < 2; i++)
+		levelDrop(&e->dpath[i]);
+	for(i = 0; i < 3; i++)
+		levelDrop(&e->tpath[i]);
+}
+
+void inodeUnhash(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	struct inode_entry **p = &fs->ibuckets[e->inumber % INODE_CACHE_SIZE];
+	while(*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	e->next = NULL;
+	inodeDropMaps(e);
+	e->inumber = -1;
+}
 
+//drop every entry without writing it back, used when the disk
+//underneath has been reformatted or remounted
+void inodeReset(struct fs *fs)
+{
+	int i;
+	for(i = 0; i < INODE_CACHE_SIZE; i++)
+	{
+		inodeDropMaps(&fs->icache[i]);
+		memset(&fs->icache[i], 0, sizeof(fs->icache[i]));
+		fs->icache[i].fs = fs;
+		pthread_rwlock_init(&fs->icache[i].lock, NULL);
+		pthread_mutex_init(&fs->icache[i].maplock, NULL);
+		fs->icache[i].inumber = -1;
+		fs->ibuckets[i] = NULL;
+	}
+	fs->ihand = 0;
+}
+void inodeFlushAll(struct fs *fs)
+{
+	int i;
+	for(i = 0; i < INODE_CACHE_SIZE; i++)
+	{
+		if(fs->icache[i].inumber != -1)
+			inodeWriteBack(&fs->icache[i]);
+	}
+}
 
+//decoded inode for inumber, read from the inode block on a miss.  The
+//entry stays put until the matching inodePut; the caller takes its lock.
+//clock sweep for a slot that hasn't been used lately, NULL when two
+//full turns find every slot in use.  An inode whose buffered data
+//found no room on the disk keeps its slot while any other will do.
+//caller holds icachelock
+struct inode_entry *inodeVictim(struct fs *fs)
+{
+	struct inode_entry *e, *stuck = NULL;
+	int n;
 
-	/*blocknum = blockToWrite(&offset, inodeblock.inode[inode]);
-	blockremaining = blocksize - offset;
-	while(length > blocksize)
+	for(n = 0; n < 2 * INODE_CACHE_SIZE; n++)
+	{
+		e = &fs->icache[fs->ihand];
+		fs->ihand = (fs->ihand + 1) % INODE_CACHE_SIZE;
+		if(e->inumber == -1)
+			return e;
+		if(e->users) continue;
+		if(e->referenced)
+		{
+			e->referenced = 0;
+			continue;
+		}
+		inodeWriteBack(e);
+		if(e->npend)
+		{
+			stuck = e;
+			continue;
+		}
+		inodeUnhash(e);
+		return e;
+	}
+	if(stuck)
 	{
-		memcpy(
-	}*/
+		printf("Error: disk full, buffered data of inode %d lost\n", stuck->inumber);
+		pendDrop(stuck);
+		inodeUnhash(stuck);
+	}
+	return stuck;
+}
 
+struct inode_entry *inodeGet(struct fs *fs, int inumber)
+{
+	struct inode_entry *e;
+	union fs_block block;
 
-	//direct first, maybe we adjust to do like read later
-	int i, blocknum, id = -1;
-	for(i=0; i < POINTERS_PER_INODE + POINTERS_PER_BLOCK; i++)
+	pthread_mutex_lock(&fs->icachelock);
+	for(e = fs->ibuckets[inumber % INODE_CACHE_SIZE]; e; e = e->next)
 	{
-		if(i < POINTERS_PER_INODE)
+		if(e->inumber == inumber)
 		{
-			//direct blocks
-			//if there's no block in place, we need to allocate one
-			blocknum = inodeblock.inode[inode].direct[i];
-			printf("found direct block %d in place\n", blocknum);
+			e->referenced = 1;
+			e->users++;
+			pthread_mutex_unlock(&fs->icachelock);
+			return e;
 		}
-		else
+	}
+
+	//every slot is held by a caller, wait for one to be put back, by
+	//when someone else may have brought this inode in
+	while(!(e = inodeVictim(fs)))
+	{
+		pthread_cond_wait(&fs->islotfree, &fs->icachelock);
+		for(e = fs->ibuckets[inumber % INODE_CACHE_SIZE]; e; e = e->next)
 		{
-			//indirect block
-			if(inodeblock.inode[inode].indirect == 0)
+			if(e->inumber == inumber)
 			{
-				id = getFreeBlock();
-				inodeblock.inode[inode].indirect = id;
-				printf("found indirect block to allocate %d\n", id);
+				e->referenced = 1;
+				e->users++;
+				pthread_mutex_unlock(&fs->icachelock);
+				return e;
 			}
-			disk_read(inodeblock.inode[inode].indirect, idblock.data);
-			blocknum = idblock.pointers[i-POINTERS_PER_INODE];
 		}
-		if(blocknum == 0)
+	}
+
+	//past the lazy init mark every inode is free
+	if (inumber / fs->inodesperblock + 1 > fs->inodeinit)
+		memset(block.data, 0, sizeof(block.data));
+	else
+		cache_read_r(fs->cache, inumber / fs->inodesperblock + 1, block.data);
+	inodeDecode(fs, &block, inumber % fs->inodesperblock, &e->inode);
+	e->inumber = inumber;
+	e->dirty = 0;
+	e->referenced = 1;
+	e->raoff = 0;
+	e->rawindow = 0;
+	e->ranext = 0;
+	e->users = 1;
+	e->next = fs->ibuckets[inumber % INODE_CACHE_SIZE];
+	fs->ibuckets[inumber % INODE_CACHE_SIZE] = e;
+	pthread_mutex_unlock(&fs->icachelock);
+	return e;
+}
+
+void inodePut(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	pthread_mutex_lock(&fs->icachelock);
+	if(!--e->users)
+		pthread_cond_broadcast(&fs->islotfree);
+	pthread_mutex_unlock(&fs->icachelock);
+}
+
+//indirect pointers for a cached inode, allocating the indirect block
+//when alloc is set and the inode doesn't have one yet
+int *inodeIndirect(struct inode_entry *e, int alloc)
+{
+	struct fs *fs = e->fs;
+	if(e->indirect)
+		return e->indirect;
+
+	if(e->inode.indirect <= 0 || e->inode.indirect >= fs->nblocks)
+	{
+		if(!alloc)
+			return NULL;
+		int id = getFreeBlock(fs);
+		if(id == -1)
+			return NULL;
+		e->indirect = calloc(POINTERS_PER_BLOCK, sizeof(int));
+		if(!e->indirect)
 		{
-			blocknum = getFreeBlock();
-			printf("found direct block to allocate %d\n", blocknum);
-			if(blocknum == -1)
-			{
-				printf("Error: No free blocks found\n");
-				return 0;
-			}
-			if(i < POINTERS_PER_INODE)
-				inodeblock.inode[inode].direct[i] = blocknum;
+			freeBlock(fs, id);
+			return NULL;
 		}
-		disk_read(blocknum, datablock.data);
-		printf("read from block %d\n", blocknum);
+		e->inode.indirect = id;
+		e->dirty = 1;
+		e->indirectdirty = 1;
+		return e->indirect;
+	}
 
-		if(offset > blocksize)
+	e->indirect = malloc(DISK_BLOCK_SIZE);
+	if(!e->indirect)
+		return NULL;
+	cache_read_r(fs->cache, e->inode.indirect, (char *) e->indirect);
+	return e->indirect;
+}
+
+int extentReserve(struct inode_entry *e, int n)
+{
+	struct extent *ext;
+
+	if(n <= e->extcap)
+		return 1;
+	if(n < e->extcap * 2)
+		n = e->extcap * 2;
+	ext = realloc(e->ext, n * sizeof(struct extent));
+	if(!ext)
+		return 0;
+	e->ext = ext;
+	e->extcap = n;
+	return 1;
+}
+
+//add a run at the logical end of the file, merging with the last
+//extent when both are holes or the blocks follow on physically
+int extentAppend(struct inode_entry *e, int start, int length)
+{
+	struct extent *last = e->nextents ? &e->ext[e->nextents - 1] : NULL;
+	int lblock;
+
+	if(last && ((last->start == 0 && start == 0) ||
+	            (last->start != 0 && start == last->start + last->length)))
+	{
+		last->length += length;
+		return 1;
+	}
+
+	//extentReserve may move the list, taking last with it
+	lblock = last ? last->lblock + last->length : 0;
+	if(!extentReserve(e, e->nextents + 1))
+		return 0;
+	e->ext[e->nextents].lblock = lblock;
+	e->ext[e->nextents].start = start;
+	e->ext[e->nextents].length = length;
+	e->nextents++;
+	return 1;
+}
+
+//read the extent list of a cached inode into memory
+int extentLoad(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	union fs_block block;
+	int i, n, next, *ovf;
+
+	if(e->ext)
+		return 1;
+
+	n = e->inode.nextents;
+	e->nextents = 0;
+	e->extcap = 0;
+	e->exthint = 0;
+	if(!extentReserve(e, n > 4 ? n : 4))
+		return 0;
+
+	for(i = 0; i < n && i < EXTENTS_PER_INODE; i++)
+		extentAppend(e, e->inode.extent[i].start, e->inode.extent[i].length);
+
+	next = e->inode.overflow;
+	while(i < n && next > 0 && next < fs->nblocks)
+	{
+		ovf = realloc(e->overflow, (e->noverflow + 1) * sizeof(int));
+		if(!ovf)
+			return 0;
+		e->overflow = ovf;
+		e->overflow[e->noverflow++] = next;
+
+		cache_read_r(fs->cache, next, block.data);
+		int k;
+		for(k = 0; k < block.extents.count && k < EXTENTS_PER_BLOCK && i < n; k++, i++)
+			extentAppend(e, block.extents.extent[k].start, block.extents.extent[k].length);
+		next = block.extents.next;
+	}
+	return 1;
+}
+
+//write the in-memory extent list back to the inode and overflow chain
+int extentStore(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	union fs_block block;
+	int i, k, n = e->nextents;
+	int needed = n > EXTENTS_PER_INODE ? (n - EXTENTS_PER_INODE + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+
+	if(needed > e->noverflow)
+	{
+		int *ovf = realloc(e->overflow, needed * sizeof(int));
+		if(!ovf)
+			return 0;
+		e->overflow = ovf;
+		while(e->noverflow < needed)
 		{
-			printf("offset over a block\n");
-			offset -= blocksize;
-			continue;
+			int b = getFreeBlock(fs);
+			if(b == -1)
+				return 0;
+			e->overflow[e->noverflow++] = b;
 		}
-		else if(offset > 0)
+	}
+	while(e->noverflow > needed)
+		freeBlock(fs, e->overflow[--e->noverflow]);
+
+	memset(e->inode.extent, 0, sizeof(e->inode.extent));
+	for(i = 0; i < n && i < EXTENTS_PER_INODE; i++)
+	{
+		e->inode.extent[i].start = e->ext[i].start;
+		e->inode.extent[i].length = e->ext[i].length;
+	}
+	for(k = 0; k < needed; k++)
+	{
+		memset(block.data, 0, sizeof(block.data));
+		block.extents.next = k + 1 < needed ? e->overflow[k + 1] : 0;
+		for(; i < n && block.extents.count < EXTENTS_PER_BLOCK; i++, block.extents.count++)
 		{
-			printf("offset less than a block, copying\n");
-			blockremaining = blocksize-offset;	
-			memcpy(datablock.data + offset, data, blockremaining);
-			offset -= offset;
-			byteswritten += blockremaining;
+			block.extents.extent[block.extents.count].start = e->ext[i].start;
+			block.extents.extent[block.extents.count].length = e->ext[i].length;
 		}
+		cache_write_r(fs->cache, e->overflow[k], block.data);
+	}
+
+	e->inode.nextents = n;
+	e->inode.overflow = needed ? e->overflow[0] : 0;
+	e->dirty = 1;
+	e->extdirty = 0;
+	return 1;
+}
+
+//index of the extent covering logical block b, -1 past the end
+int extentFind(struct inode_entry *e, int b)
+{
+	int lo = 0, hi = e->nextents - 1, h = e->exthint;
+
+	//sequential access almost always lands in the same or next extent
+	if(h < e->nextents && e->ext[h].lblock <= b)
+	{
+		if(b < e->ext[h].lblock + e->ext[h].length)
+			return h;
+		if(h + 1 < e->nextents && b < e->ext[h + 1].lblock + e->ext[h + 1].length)
+			return e->exthint = h + 1;
+	}
+
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(b < e->ext[mid].lblock)
+			hi = mid - 1;
+		else if(b >= e->ext[mid].lblock + e->ext[mid].length)
+			lo = mid + 1;
+		else
+			return e->exthint = mid;
+	}
+	return -1;
+}
+
+//map logical block b to the physical block p, in place of a hole or
+//of the block it had
+int extentSet(struct inode_entry *e, int b, int p)
+{
+	int end = e->nextents ? e->ext[e->nextents - 1].lblock + e->ext[e->nextents - 1].length : 0;
+
+	if(b >= end)
+	{
+		if(b > end && !extentAppend(e, 0, b - end))
+			return 0;
+		return extentAppend(e, p, 1);
+	}
+
+	int idx = extentFind(e, b);
+	struct extent old = e->ext[idx];
+	struct extent piece[3];
+	int npiece = 0, at = idx;
+
+	if(b > old.lblock)
+	{
+		piece[npiece].lblock = old.lblock;
+		piece[npiece].start = old.start;
+		piece[npiece++].length = b - old.lblock;
+		at = idx + 1;
+	}
+	piece[npiece].lblock = b;
+	piece[npiece].start = p;
+	piece[npiece++].length = 1;
+	if(b + 1 < old.lblock + old.length)
+	{
+		piece[npiece].lblock = b + 1;
+		piece[npiece].start = old.start ? old.start + b + 1 - old.lblock : 0;
+		piece[npiece++].length = old.lblock + old.length - b - 1;
+	}
+
+	if(!extentReserve(e, e->nextents + npiece - 1))
+		return 0;
+	memmove(&e->ext[idx + npiece], &e->ext[idx + 1], (e->nextents - idx - 1) * sizeof(struct extent));
+	memcpy(&e->ext[idx], piece, npiece * sizeof(struct extent));
+	e->nextents += npiece - 1;
+
+	//glue the new block onto physically adjacent neighbours
+	if(at + 1 < e->nextents && e->ext[at + 1].start == p + 1)
+	{
+		e->ext[at].length += e->ext[at + 1].length;
+		memmove(&e->ext[at + 1], &e->ext[at + 2], (e->nextents - at - 2) * sizeof(struct extent));
+		e->nextents--;
+	}
+	if(at > 0 && e->ext[at - 1].start != 0 && e->ext[at - 1].start + e->ext[at - 1].length == p)
+	{
+		e->ext[at - 1].length += e->ext[at].length;
+		memmove(&e->ext[at], &e->ext[at + 1], (e->nextents - at - 1) * sizeof(struct extent));
+		e->nextents--;
+	}
+	e->exthint = 0;
+	return 1;
+}
+
+//slot holding the pointer for logical block b when it lies under the
+//double or triple indirect block.  Walks down from the inode through
+//the cached path, so runs of neighbouring blocks only touch the last
+//level.  With alloc set, missing pointer blocks are allocated on the
+//way and *dirty is pointed at the flag to raise when the slot changes.
+int *deepSlot(struct inode_entry *e, int b, int alloc, int **dirty)
+{
+	struct fs *fs = e->fs;
+	struct indlevel *path;
+	int digit[3];
+	int *slot, *slotdirty;
+	int depth, i;
+
+	if(!(fs->features & FS_FEATURE_BIGFILE))
+		return NULL;
+
+	b -= POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+	if(b < POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+	{
+		path = e->dpath;
+		depth = 2;
+		slot = &e->inode.dindirect;
+		digit[0] = b / POINTERS_PER_BLOCK;
+		digit[1] = b % POINTERS_PER_BLOCK;
+	}
+	else
+	{
+		b -= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+		if(b >= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+			return NULL;
+		path = e->tpath;
+		depth = 3;
+		slot = &e->inode.tindirect;
+		digit[0] = b / (POINTERS_PER_BLOCK * POINTERS_PER_BLOCK);
+		digit[1] = (b / POINTERS_PER_BLOCK) % POINTERS_PER_BLOCK;
+		digit[2] = b % POINTERS_PER_BLOCK;
+	}
+	slotdirty = &e->dirty;
 
-		printf("remaining offset is %d\n", offset);
-		blockremaining = blocksize;
-		if(offset <= 0)
+	for(i = 0; i < depth; i++)
+	{
+		int *ptrs;
+		if(*slot <= 0 || *slot >= fs->nblocks)
 		{
-			if(length == 0)
+			if(!alloc)
+				return NULL;
+			int id = getFreeBlock(fs);
+			if(id == -1)
+				return NULL;
+			ptrs = levelLoad(fs, &path[i], id, 1);
+			if(!ptrs)
 			{
-				printf("breaking\n");
-				break;
+				freeBlock(fs, id);
+				return NULL;
 			}
+			*slot = id;
+			*slotdirty = 1;
+		}
+		else
+		{
+			ptrs = levelLoad(fs, &path[i], *slot, 0);
+			if(!ptrs)
+				return NULL;
+		}
+		slot = &ptrs[digit[i]];
+		slotdirty = &path[i].dirty;
+	}
 
-			if(length >= blockremaining)
-			{
-				memcpy(datablock.data + byteswritten, data, blockremaining);
-				length -= blockremaining;
-				byteswritten += blockremaining;
-			}
-			else if(length < blockremaining)
+	if(dirty)
+		*dirty = slotdirty;
+	return slot;
+}
+
+//physical block holding logical block b of a file, 0 for a hole
+int fileBlock(struct inode_entry *e, int b)
+{
+	struct fs *fs = e->fs;
+	if(fs->features & FS_FEATURE_EXTENTS)
+	{
+		if(!extentLoad(e))
+			return 0;
+		int idx = extentFind(e, b);
+		if(idx < 0 || e->ext[idx].start == 0)
+			return 0;
+		return e->ext[idx].start + b - e->ext[idx].lblock;
+	}
+
+	if(b < POINTERS_PER_INODE)
+		return e->inode.direct[b];
+	if(b < POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+	{
+		int *indirect = inodeIndirect(e, 0);
+		return indirect ? indirect[b - POINTERS_PER_INODE] : 0;
+	}
+	int *slot = deepSlot(e, b, 0, NULL);
+	return slot ? *slot : 0;
+}
+
+//like fileBlock, but allocates a block for a hole; sets *fresh when
+//the block is new and -1 means the disk is full or b is out of range
+int fileMapBlock(struct inode_entry *e, int b, int *fresh)
+{
+	struct fs *fs = e->fs;
+	int blocknum = fileBlock(e, b);
+	int prev = b > 0 ? fileBlock(e, b - 1) : 0;
+	int goal = prev > 0 ? prev + 1 : 0;
+
+	*fresh = 0;
+	if(blocknum > 0 && blocknum < fs->nblocks)
+		return blocknum;
+
+	if(fs->features & FS_FEATURE_EXTENTS)
+	{
+		if(!extentLoad(e))
+			return -1;
+		blocknum = getFreeBlockNear(fs, goal);
+		if(blocknum == -1)
+			return -1;
+		if(!extentSet(e, b, blocknum))
+		{
+			freeBlock(fs, blocknum);
+			return -1;
+		}
+		e->extdirty = 1;
+	}
+	else if(b < POINTERS_PER_INODE)
+	{
+		blocknum = getFreeBlockNear(fs, goal);
+		if(blocknum == -1)
+			return -1;
+		e->inode.direct[b] = blocknum;
+		e->dirty = 1;
+	}
+	else if(b < POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+	{
+		int *indirect = inodeIndirect(e, 1);
+		if(!indirect)
+			return -1;
+		blocknum = getFreeBlockNear(fs, goal);
+		if(blocknum == -1)
+			return -1;
+		indirect[b - POINTERS_PER_INODE] = blocknum;
+		e->indirectdirty = 1;
+	}
+	else
+	{
+		int *dirty;
+		int *slot = deepSlot(e, b, 1, &dirty);
+		if(!slot)
+			return -1;
+		blocknum = getFreeBlockNear(fs, goal);
+		if(blocknum == -1)
+			return -1;
+		*slot = blocknum;
+		*dirty = 1;
+	}
+
+	*fresh = 1;
+	return blocknum;
+}
+
+//point logical block b, which is mapped, at physical block p instead,
+//0 making it a hole.  the pointer blocks on the way are the file's own,
+//clones get copies
+int fileRemapBlock(struct inode_entry *e, int b, int p)
+{
+	struct fs *fs = e->fs;
+
+	if(fs->features & FS_FEATURE_EXTENTS)
+	{
+		if(!extentSet(e, b, p))
+			return 0;
+		e->extdirty = 1;
+	}
+	else if(b < POINTERS_PER_INODE)
+	{
+		e->inode.direct[b] = p;
+		e->dirty = 1;
+	}
+	else if(b < POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+	{
+		int *indirect = inodeIndirect(e, 0);
+		if(!indirect)
+			return 0;
+		indirect[b - POINTERS_PER_INODE] = p;
+		e->indirectdirty = 1;
+	}
+	else
+	{
+		int *dirty;
+		int *slot = deepSlot(e, b, 0, &dirty);
+		if(!slot)
+			return 0;
+		*slot = p;
+		*dirty = 1;
+	}
+	return 1;
+}
+
+//give back block p, just mapped at logical block b for data that never
+//arrived.  if the mapping can't be undone the block is zeroed instead
+void unmapBlock(struct inode_entry *e, int b, int p)
+{
+	union fs_block block;
+
+	if(fileRemapBlock(e, b, 0))
+	{
+		freeBlock(e->fs, p);
+		return;
+	}
+	memset(block.data, 0, sizeof(block.data));
+	cache_write_r(e->fs->cache, p, block.data);
+}
+
+//fileMapBlock for a block about to be written.  One still shared with
+//a clone is first swapped for a block of the file's own, holding a copy
+//of the old contents when copy is set
+int fileWriteBlock(struct inode_entry *e, int b, int *fresh, int copy)
+{
+	struct fs *fs = e->fs;
+	union fs_block block;
+	int blocknum = fileMapBlock(e, b, fresh);
+
+	if(blocknum == -1 || *fresh || !refShared(fs, blocknum))
+		return blocknum;
+
+	int prev = b > 0 ? fileBlock(e, b - 1) : 0;
+	int own = getFreeBlockNear(fs, prev > 0 ? prev + 1 : 0);
+	if(own == -1)
+		return -1;
+	if(copy)
+	{
+		cache_read_r(fs->cache, blocknum, block.data);
+		cache_write_r(fs->cache, own, block.data);
+	}
+	if(!fileRemapBlock(e, b, own))
+	{
+		freeBlock(fs, own);
+		return -1;
+	}
+	trace(TRACE_INODE, TRACE_DEBUG, "inode %d: block %d copied from %d to %d", e->inumber, b, blocknum, own);
+	//the other owners may have let go meanwhile, in which case this
+	//frees it
+	freeBlock(fs, blocknum);
+	return own;
+}
+
+//pick up the layout described by a superblock
+void setGeometry(struct fs *fs, const struct fs_superblock *super)
+{
+	fs->ninodeblocks = super->ninodeblocks;
+	fs->nblocks = super->nblocks;
+	fs->ninodes = super->ninodes;
+	fs->features = 0;
+	fs->nbitmapblocks = 0;
+	fs->ninodemapblocks = 0;
+	fs->nrefblocks = 0;
+	fs->inodesize = INODE_SIZE_SMALL;
+	fs->inodeinit = super->ninodeblocks;
+	if (super->magic == FS_MAGIC_REV)
+	{
+		fs->features = super->features;
+		if (fs->features & FS_FEATURE_BLOCKMAP)
+			fs->nbitmapblocks = super->nbitmapblocks;
+		if (fs->features & FS_FEATURE_INODEMAP)
+			fs->ninodemapblocks = super->ninodemapblocks;
+		if (fs->features & FS_FEATURE_REFCOUNT)
+			fs->nrefblocks = super->nrefblocks;
+		if (super->inodesize)
+			fs->inodesize = super->inodesize;
+		if ((fs->features & FS_FEATURE_LAZYINIT) && super->inodeinit >= 0 &&
+		    super->inodeinit < super->ninodeblocks)
+			fs->inodeinit = super->inodeinit;
+	}
+	fs->inodesperblock = DISK_BLOCK_SIZE / fs->inodesize;
+}
+
+//superblock goes straight to disk so the state flag is never stale
+void writeSuper(struct fs *fs, int state)
+{
+	union fs_block block;
+	cache_read_r(fs->cache, 0, block.data);
+	block.super.state = state;
+	block.super.nshared = fs->nshared;
+	cache_write_r(fs->cache, 0, block.data);
+	cache_flush_r(fs->cache, 0);
+}
+
+//make inode block blocknum safe to write, zeroing the table from the
+//mark up to it and a little beyond.  The zeroes reach the disk before
+//the superblock moves the mark, so a crash never leaves stale data
+//inside the initialized part of the table
+void inodeInitTo(struct fs *fs, int blocknum)
+{
+	static char zero[DISK_BLOCK_SIZE];
+	struct disk_io io[INIT_CHUNK];
+	union fs_block block;
+	int n, i;
+
+	pthread_mutex_lock(&fs->icachelock);
+	if (blocknum <= fs->inodeinit)
+	{
+		pthread_mutex_unlock(&fs->icachelock);
+		return;
+	}
+	int upto = fs->inodeinit + INIT_CHUNK;
+	if (upto < blocknum)
+		upto = blocknum;
+	if (upto > fs->ninodeblocks)
+		upto = fs->ninodeblocks;
+	trace(TRACE_INODE, TRACE_DEBUG, "initializing inode blocks %d to %d", fs->inodeinit + 1, upto);
+
+	//punched blocks read back as zeroes, otherwise write them out
+	if (!cache_discard_r(fs->cache, fs->inodeinit + 1, upto - fs->inodeinit))
+	{
+		for (n = fs->inodeinit + 1; n <= upto; n += i)
+		{
+			for (i = 0; i < INIT_CHUNK && n + i <= upto; i++)
 			{
-				printf("performing last copy\n");
-				//this is the last part to copy
-				memcpy(datablock.data + byteswritten, data + byteswritten, length);
-				//printf(">>>>>");
-				//printf("%s", data);
-				//printf("<<<<<<\n");
-				byteswritten += length;
-				inodeblock.inode[inode].size = byteswritten;
-				disk_write(iblock, inodeblock.data);
-				if (id != -1)
-					disk_write(id, idblock.data);
-				disk_write(blocknum, datablock.data);
-				//printf("writing out to block %d\n", blocknum);
-				return byteswritten;
+				io[i].blocknum = n + i;
+				io[i].data = zero;
 			}
-			blockremaining = blocksize;
+			cache_writev_r(fs->cache, io, i);
 		}
-		disk_write(blocknum, datablock.data);
-		//printf("writing out to block %d\n", blocknum);
 	}
 
-	inodeblock.inode[inode].size = byteswritten;
-	disk_write(iblock, inodeblock.data);
-	if(id != -1)
-		disk_write(id, idblock.data);
-	disk_write(blocknum, datablock.data);
-	//printf("writing out to block %d\n", blocknum);
-	return byteswritten;
+	cache_read_r(fs->cache, 0, block.data);
+	block.super.inodeinit = upto;
+	cache_write_r(fs->cache, 0, block.data);
+	cache_flush_r(fs->cache, 0);
+	fs->inodeinit = upto;
+	pthread_mutex_unlock(&fs->icachelock);
+}
+
+int formatDisk(struct fs *fs, int flags)
+{
+	//if(fs_mount())	//do not run on already mounted disk
+	if (fs->mounted)	
+		return 0;
+
+	int nblocks = fs->disk ? disk_size_r(fs->disk) : disk_size();
+	int ninodeblocks = (nblocks + 9)/10;
+	//this unusual division is to ensure rounding up
+	//for some bizarre reason, the ceil function was acting up
+	trace(TRACE_FS, TRACE_INFO, "format: %d blocks, %d inode blocks, flags 0x%x", nblocks, ninodeblocks, flags);
+	//inumbers are int, keep the table addressable
+	if (ninodeblocks > INT_MAX / (DISK_BLOCK_SIZE / INODE_SIZE_LARGE))
+		ninodeblocks = INT_MAX / (DISK_BLOCK_SIZE / INODE_SIZE_LARGE);
+	int inodesize = (flags & FS_FORMAT_INLINE) ? INODE_SIZE_INLINE : INODE_SIZE_LARGE;
+	int ninodes = ninodeblocks * (DISK_BLOCK_SIZE / inodesize);
+	int nbitmapblocks = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	int ninodemapblocks = (ninodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	int nrefblocks = (nblocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+	//an image with no block to spare for the counts can't clone
+	if (1 + ninodeblocks + nbitmapblocks + ninodemapblocks + nrefblocks >= nblocks)
+		nrefblocks = 0;
+	//superblock, inode table, both maps and the reference counts are in use
+	int used = 1 + ninodeblocks + nbitmapblocks + ninodemapblocks + nrefblocks;
+	if (used >= nblocks)
+		return 0;	//no room left for data
+	
+	inodeReset(fs);
 
-	//return 0;
+	union fs_block block;
+	memset(block.data, 0, sizeof(block.data));
+	//set superblock data
+	block.super.magic = FS_MAGIC_REV;
+	block.super.nblocks = nblocks;
+	block.super.ninodeblocks = ninodeblocks;
+	block.super.ninodes = ninodes;
+	block.super.features = FS_FEATURE_BLOCKMAP | FS_FEATURE_INODEMAP | FS_FEATURE_BIGFILE | FS_FEATURE_LARGEFILE;
+	if (flags & FS_FORMAT_EXTENTS)
+		block.super.features |= FS_FEATURE_EXTENTS;
+	//the table is left as it is and zeroed on first use
+	if (flags & FS_FORMAT_LAZY)
+		block.super.features |= FS_FEATURE_LAZYINIT;
+	if (flags & FS_FORMAT_INLINE)
+		block.super.features |= FS_FEATURE_INLINEDATA;
+	if (nrefblocks)
+		block.super.features |= FS_FEATURE_REFCOUNT;
+	block.super.state = FS_STATE_CLEAN;
+	block.super.nbitmapblocks = nbitmapblocks;
+	block.super.ninodemapblocks = ninodemapblocks;
+	block.super.nrefblocks = nrefblocks;
+	block.super.inodesize = inodesize;
+	cache_write_r(fs->cache, 0, block.data);  //write superblock to disk
+
+	//hand everything past the superblock back to the host, which
+	//also zeroes the inode table when the image can be punched
+	int zeroed = cache_discard_r(fs->cache, 1, nblocks - 1);
+
+	//clear out inodes, write to disk
+	int i;
+	memset(block.data, 0, sizeof(block.data));
+	//start at 1, 0 is superblock above
+	if (!zeroed && !(flags & FS_FORMAT_LAZY))
+	{
+		for (i = 1; i <= ninodeblocks; i++)
+			cache_write_r(fs->cache, i, block.data);
+	}
+	//counts are read as soon as a block is shared, even lazily formatted
+	//they have to start out zero
+	int refstart = ninodeblocks + 1 + nbitmapblocks + ninodemapblocks;
+	if (!zeroed)
+	{
+		for (i = refstart; i < refstart + nrefblocks; i++)
+			cache_write_r(fs->cache, i, block.data);
+	}
+
+	if (!mapInit(&fs->fbb, nblocks, ninodeblocks + 1, nbitmapblocks) ||
+	    !mapInit(&fs->fib, ninodes, ninodeblocks + 1 + nbitmapblocks, ninodemapblocks) ||
+	    !refInit(&fs->refs, refstart, nrefblocks))
+		return 0;
+	fs->nshared = 0;
+	for (i = 0; i < used; i++)
+		mapSet(&fs->fbb, i);
+	mapSet(&fs->fib, 0);
+	mapDirtyAll(&fs->fbb);
+	//past the mark the inode map isn't read either, only the block
+	//holding inumber 0 has to be written
+	if (!(flags & FS_FORMAT_LAZY))
+		mapDirtyAll(&fs->fib);
+	flushBitmap(fs);
+	cache_sync_r(fs->cache);
+
+	return 1;
+}
+
+void debugDisk(struct fs *fs)
+{
+	union fs_block block, idblock;
+	struct fs_inode inode, *in = &inode;
+
+	//inode table on disk has to reflect the cached inodes
+	if(fs->mounted)
+		inodeFlushAll(fs);
+	cache_read_r(fs->cache, 0, block.data);
+
+	printf("superblock:\n");
+	printf("    %d blocks\n",block.super.nblocks);
+	printf("    %d inode blocks\n",block.super.ninodeblocks);
+	printf("    %d inodes\n",block.super.ninodes);
+	if(block.super.magic == FS_MAGIC_REV)
+	{
+		printf("    %d bitmap blocks\n",block.super.nbitmapblocks);
+		if(block.super.features & FS_FEATURE_INODEMAP)
+			printf("    %d inode bitmap blocks\n",block.super.ninodemapblocks);
+		if(block.super.features & FS_FEATURE_LAZYINIT)
+			printf("    %d inode blocks initialized\n",block.super.inodeinit);
+		if(block.super.features & FS_FEATURE_REFCOUNT)
+			printf("    %d reference count blocks, %d shared\n",block.super.nrefblocks,
+				fs->mounted ? fs->nshared : block.super.nshared);
+		printf("    features 0x%x, %s\n",block.super.features,
+			(block.super.state & FS_STATE_CLEAN) ? "clean" : "not clean");
+	}
+	if(!fs->mounted)
+		setGeometry(fs, &block.super);
+
+	int n = 0;
+
+	//printf("num blocks is %d\n", nblocks);
+	
+	//maybe also read the indirect block to get the data
+		//that it points to
+	int i, j, k;
+	for (n = 1; n <= fs->inodeinit; n++)	//start at 1, 0 is done above
+	{
+		cache_read_r(fs->cache, n, block.data); 
+		//printf("block: %d\n", n);
+
+		for (i = 0; i < fs->inodesperblock; i++) 
+		{
+			//skip if inode is empty or invalid
+			inodeDecode(fs, &block, i, in);
+			if(in->isvalid == 0) continue;
+
+			printf("inode %d:\n", blockToInode(fs, n, i));
+			printf("    size: %lld bytes\n", (long long) inodeSize(in));
+			if (in->flags & INODE_FLAG_INLINE)
+			{
+				printf("    inline data\n");
+				continue;
+			}
+			if (in->flags & INODE_FLAG_DIR)
+				printf("    directory\n");
+			if (fs->features & FS_FEATURE_EXTENTS)
+			{
+				printf("    extents: ");
+				for (j = 0; j < EXTENTS_PER_INODE && j < in->nextents; j++)
+					printf("%d+%d ", in->extent[j].start, in->extent[j].length);
+				for (k = in->overflow; j < in->nextents && k > 0 && k < fs->nblocks; k = idblock.extents.next)
+				{
+					cache_read_r(fs->cache, k, idblock.data);
+					int x;
+					for (x = 0; x < idblock.extents.count && x < EXTENTS_PER_BLOCK; x++, j++)
+						printf("%d+%d ", idblock.extents.extent[x].start, idblock.extents.extent[x].length);
+				}
+				printf("\n");
+				continue;
+			}
+			printf("    direct blocks: ");
+
+			for (j = 0; j < POINTERS_PER_INODE; j++) 
+			{
+				if (in->direct[j] != 0)
+					printf("%d ", in->direct[j]);
+			}
+			printf("\n");
+			if (in->indirect != 0)
+			{
+				printf("    indirect block: %d\n", in->indirect);
+				printf("    indirect data blocks: ");
+				cache_read_r(fs->cache, in->indirect, idblock.data);
+				for(k=0; k < POINTERS_PER_BLOCK; k++)
+				{
+					if(idblock.pointers[k] > 0 && idblock.pointers[k] < fs->nblocks)
+					{
+						printf("%d ", idblock.pointers[k]);
+					}
+				}
+				printf("\n");
+			}
+			if (in->dindirect != 0)
+				printf("    double indirect block: %d\n", in->dindirect);
+			if (in->tindirect != 0)
+				printf("    triple indirect block: %d\n", in->tindirect);
+				
+		}
+	}
+}
+
+//mark block b in use; one already marked belongs to a clone as well
+void markBlock(struct fs *fs, int b)
+{
+	if (bitmap_test(&fs->fbb.bits, b) && fs->refs.nblocks)
+		refAdd(fs, b, 1);
+	else
+		bitmap_set(&fs->fbb.bits, b);
+}
+
+//mark the data and overflow blocks of an extent-mapped inode in use
+void markExtents(struct fs *fs, struct fs_inode *in)
+{
+	union fs_block block;
+	int i, b, n = 0, next = in->overflow;
+
+	for (i = 0; i < EXTENTS_PER_INODE && n < in->nextents; i++, n++)
+	{
+		for (b = in->extent[i].start; in->extent[i].start > 0 && b < in->extent[i].start + in->extent[i].length && b < fs->nblocks; b++)
+			markBlock(fs, b);
+	}
+	while (n < in->nextents && next > 0 && next < fs->nblocks)
+	{
+		markBlock(fs, next);
+		cache_read_r(fs->cache, next, block.data);
+		for (i = 0; i < block.extents.count && i < EXTENTS_PER_BLOCK; i++, n++)
+		{
+			struct fs_extent *x = &block.extents.extent[i];
+			for (b = x->start; x->start > 0 && b < x->start + x->length && b < fs->nblocks; b++)
+				markBlock(fs, b);
+		}
+		next = block.extents.next;
+	}
+}
+
+//mark an indirect block and everything under it in use, depth 1
+//being a block of data block pointers
+void markTree(struct fs *fs, int blocknum, int depth)
+{
+	union fs_block block;
+	int k;
+
+	if (blocknum <= 0 || blocknum >= fs->nblocks)
+		return;
+	markBlock(fs, blocknum);
+	cache_read_r(fs->cache, blocknum, block.data);
+	for (k = 0; k < POINTERS_PER_BLOCK; k++)
+	{
+		if (block.pointers[k] <= fs->ninodeblocks || block.pointers[k] >= fs->nblocks)
+			continue;
+		if (depth > 1)
+			markTree(fs, block.pointers[k], depth - 1);
+		else
+			markBlock(fs, block.pointers[k]);
+	}
+}
+
+//walk every inode to work out which blocks and inodes are in use
+//used for old images and for ones that were not cleanly unmounted
+void rebuildBitmap(struct fs *fs, int doblocks, int doinodes)
+{
+	union fs_block block;
+	struct fs_inode in;
+	int i, j, k;
+
+	//nothing lives past the lazy init mark
+	for (i = 1; i <= fs->inodeinit; i++)
+	{
+		//keep the next stretch of the table on its way in while
+		//this one is scanned
+		if (i % SCAN_CHUNK == 1)
+		{
+			if (i == 1)
+				cache_prefetch_r(fs->cache, 1, fs->inodeinit < SCAN_CHUNK ? fs->inodeinit : SCAN_CHUNK);
+			if (i + SCAN_CHUNK <= fs->inodeinit)
+				cache_prefetch_r(fs->cache, i + SCAN_CHUNK, fs->inodeinit - i - SCAN_CHUNK + 1 < SCAN_CHUNK ?
+					fs->inodeinit - i - SCAN_CHUNK + 1 : SCAN_CHUNK);
+		}
+		cache_read_r(fs->cache, i, block.data);
+		for (j = 0; j < fs->inodesperblock; j++)
+		{		
+			inodeDecode(fs, &block, j, &in);
+			if (in.isvalid == 0) continue;
+			if (doinodes)
+				bitmap_set(&fs->fib.bits, blockToInode(fs, i, j));
+			if (!doblocks || (in.flags & INODE_FLAG_INLINE)) continue;
+			if (fs->features & FS_FEATURE_EXTENTS)
+			{
+				markExtents(fs, &in);
+				continue;
+			}
+
+			for (k = 0; k < POINTERS_PER_INODE; k++)
+			{
+				if(in.direct[k] > 0 && in.direct[k] < fs->nblocks)
+					markBlock(fs, in.direct[k]);
+			}
+			markTree(fs, in.indirect, 1);
+			markTree(fs, in.dindirect, 2);
+			markTree(fs, in.tindirect, 3);
+		}
+	}
+
+	//on-disk copies are stale, rewrite all of them
+	if (doblocks)
+		mapDirtyAll(&fs->fbb);
+	if (doinodes)
+		mapDirtyAll(&fs->fib);
+}
+
+int unmountDisk(struct fs *fs)
+{
+	if (!fs->mounted)
+		return 0;
+
+	inodeFlushAll(fs);
+	flushBitmap(fs);
+	//stay mounted with the data still buffered, so space can be freed
+	//and the unmount tried again
+	if (fs->npending)
+	{
+		cache_sync_r(fs->cache);
+		printf("Error: %d buffered blocks found no room on the disk\n", fs->npending);
+		return 0;
+	}
+	if (fs->features & (FS_FEATURE_BLOCKMAP | FS_FEATURE_INODEMAP))
+		writeSuper(fs, FS_STATE_CLEAN);
+	cache_sync_r(fs->cache);
+	fs->mounted = 0;
+	trace(TRACE_FS, TRACE_INFO, "unmounted");
+	return 1;
+}
+
+int mountDisk(struct fs *fs)
+{
+	if (fs->mounted && !unmountDisk(fs))
+		return 0;
+
+	union fs_block block;
+	cache_read_r(fs->cache, 0, block.data);
+	//filesystem is not present
+	if (block.super.magic != FS_MAGIC && block.super.magic != FS_MAGIC_REV)
+		return 0;
+
+	int n;
+	if (block.super.magic == FS_MAGIC_REV && block.super.inodesize != 0 &&
+	    block.super.inodesize != INODE_SIZE_SMALL && block.super.inodesize != INODE_SIZE_LARGE &&
+	    block.super.inodesize != INODE_SIZE_INLINE)
+		return 0;	//inode records we don't know how to read
+	setGeometry(fs, &block.super);
+	int clean = (block.super.magic == FS_MAGIC_REV) && (block.super.state & FS_STATE_CLEAN);
+	int blockmapok = clean && (fs->features & FS_FEATURE_BLOCKMAP);
+	int inodemapok = clean && (fs->features & FS_FEATURE_INODEMAP);
+	trace(TRACE_FS, TRACE_INFO, "mount: %d blocks, features 0x%x, rebuild block map %d, inode map %d",
+		fs->nblocks, fs->features, !blockmapok, !inodemapok);
+
+	if (!mapInit(&fs->fbb, fs->nblocks, fs->ninodeblocks + 1, fs->nbitmapblocks) ||
+	    !mapInit(&fs->fib, fs->ninodes, fs->ninodeblocks + 1 + fs->nbitmapblocks, fs->ninodemapblocks) ||
+	    !refInit(&fs->refs, fs->ninodeblocks + 1 + fs->nbitmapblocks + fs->ninodemapblocks, fs->nrefblocks))
+		return 0;	//something failed 
+	inodeReset(fs);
+
+	if (blockmapok)
+	{
+		mapLoad(fs, &fs->fbb, fs->nblocks);
+		fs->nshared = (fs->features & FS_FEATURE_REFCOUNT) ? block.super.nshared : 0;
+	}
+	else
+	{
+		//counts are rebuilt along with the map
+		if (!refReset(fs))
+			return 0;
+		//superblock, inode table, both maps and the counts are in use
+		for(n = 0; n <= fs->ninodeblocks + fs->nbitmapblocks + fs->ninodemapblocks + fs->nrefblocks; n++)
+			bitmap_set(&fs->fbb.bits, n);
+	}
+
+	if (inodemapok)
+		mapLoad(fs, &fs->fib, fs->inodeinit * fs->inodesperblock);
+	//inumber 0 is never handed out, set here as well since a lazily
+	//initialized table may not have the block holding it loaded
+	bitmap_set(&fs->fib.bits, 0);
+
+	if (!blockmapok || !inodemapok)
+		rebuildBitmap(fs, !blockmapok, !inodemapok);
+
+	//a crash from here on leaves the flag clear, forcing a rebuild
+	if (block.super.magic == FS_MAGIC_REV)
+		writeSuper(fs, 0);
+
+	fs->mounted = 1;
+	return 1;
+}
+
+//take fslock for a per-file call; without a mounted filesystem the
+//lock is dropped again and 0 returned
+int enterFile(struct fs *fs)
+{
+	pthread_rwlock_rdlock(&fs->fslock);
+	if(!fs->mounted)
+	{
+		pthread_rwlock_unlock(&fs->fslock);
+		printf("Error: disk not mounted.  Run mount first\n");
+		return 0;
+	}
+	return 1;
+}
+
+int fs_format_opts_r( struct fs *fs, int flags )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_FORMAT], &t);
+	pthread_rwlock_wrlock(&fs->fslock);
+	int result = formatDisk(fs, flags);
+	pthread_rwlock_unlock(&fs->fslock);
+	stats_end(&t, 0);
+	return result;
+}
+
+void fs_debug_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_DEBUG], &t);
+	pthread_rwlock_wrlock(&fs->fslock);
+	debugDisk(fs);
+	pthread_rwlock_unlock(&fs->fslock);
+	stats_end(&t, 0);
+}
+
+int fs_mount_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_MOUNT], &t);
+	pthread_rwlock_wrlock(&fs->fslock);
+	int result = mountDisk(fs);
+	pthread_rwlock_unlock(&fs->fslock);
+	stats_end(&t, 0);
+	return result;
+}
+
+int fs_unmount_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_UNMOUNT], &t);
+	pthread_rwlock_wrlock(&fs->fslock);
+	int result = unmountDisk(fs);
+	pthread_rwlock_unlock(&fs->fslock);
+	stats_end(&t, 0);
+	return result;
+}
+
+//take a free inode and set it up as an empty file, 0 when the table
+//is full.  caller is inside enterFile
+int inodeAlloc(struct fs *fs)
+{
+	pthread_mutex_lock(&fs->alloclock);
+	int inumber = mapAlloc(&fs->fib);
+	pthread_mutex_unlock(&fs->alloclock);
+	if (inumber == -1)
+		return 0;	//inode table is full
+
+	inodeInitTo(fs, inumber / fs->inodesperblock + 1);
+	struct inode_entry *e = inodeGet(fs, inumber);
+	pthread_rwlock_wrlock(&e->lock);
+	inodeDropMaps(e);
+	memset(&e->inode, 0, sizeof(e->inode));
+	e->inode.isvalid = 1;
+	if (fs->features & FS_FEATURE_INLINEDATA)
+		e->inode.flags = INODE_FLAG_INLINE;
+	e->dirty = 1;
+	pthread_rwlock_unlock(&e->lock);
+	inodePut(e);
+	return inumber;
+}
+
+int createFile(struct fs *fs)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int inumber = inodeAlloc(fs);
+	if (inumber)
+		flushBitmap(fs);
+	pthread_rwlock_unlock(&fs->fslock);
+	if (inumber)
+		trace(TRACE_INODE, TRACE_INFO, "created inode %d", inumber);
+	return inumber;
+}
+
+//free an indirect block and everything under it, depth 1 being a
+//block of data block pointers
+void freeTree(struct fs *fs, struct free_run *run, int blocknum, int depth)
+{
+	union fs_block block;
+	int k;
+
+	if (blocknum <= fs->ninodeblocks || blocknum >= fs->nblocks)
+		return;
+	cache_read_r(fs->cache, blocknum, block.data);
+	for (k = 0; k < POINTERS_PER_BLOCK; k++)
+	{
+		if (block.pointers[k] <= fs->ninodeblocks || block.pointers[k] >= fs->nblocks)
+			continue;
+		if (depth > 1)
+			freeTree(fs, run, block.pointers[k], depth - 1);
+		else
+			freeRunAdd(fs, run, block.pointers[k]);
+	}
+	freeRunAdd(fs, run, blocknum);
+}
+
+//free everything an inode owns, caller holds its lock for writing
+int inodeDelete(struct inode_entry *e)
+{
+	struct fs *fs = e->fs;
+	struct fs_inode *in = &e->inode;
+	int inumber = e->inumber;
+	struct free_run run = { 0, 0 };
+	int i;
+
+	//do not run if inode is invalid
+	if(in->isvalid == 0)
+	{
+		printf("Error: inode is invalid\n");
+		return 0;
+	}
+
+	if(fs->features & FS_FEATURE_EXTENTS)
+	{
+		if(!extentLoad(e))
+			return 0;
+		for(i=0; i < e->nextents; i++)
+		{
+			int b;
+			if(e->ext[i].start == 0) continue;
+			for(b = e->ext[i].start; b < e->ext[i].start + e->ext[i].length; b++)
+				freeRunAdd(fs, &run, b);
+		}
+		for(i=0; i < e->noverflow; i++)
+			freeRunAdd(fs, &run, e->overflow[i]);
+	}
+	else for(i=0; i<POINTERS_PER_INODE; i++)
+	{
+		if(in->direct[i] > 0 && in->direct[i] < fs->nblocks)
+			freeRunAdd(fs, &run, in->direct[i]);
+		//mark this block as free
+	}
+
+	//if this inode used indirect block, we need to clear it
+	int *indirect = (fs->features & FS_FEATURE_EXTENTS) ? NULL : inodeIndirect(e, 0);
+	if(indirect)
+	{
+		for(i=0; i < POINTERS_PER_BLOCK; i++)
+		{
+			if(indirect[i] > 0+fs->ninodeblocks && indirect[i] < fs->nblocks)
+			{
+				//only clear it if it was a valid pointer
+				//don't worry about garbage values
+				freeRunAdd(fs, &run, indirect[i]);
+			}
+		}
+		trace(TRACE_INODE, TRACE_DEBUG, "inode %d: freed indirect block %d", inumber, in->indirect);
+		freeRunAdd(fs, &run, in->indirect);
+	}
+	if(!(fs->features & FS_FEATURE_EXTENTS))
+	{
+		//trees are read back through the cache, so it needs the
+		//pointers still sitting in the cached paths
+		for(i = 0; i < 2; i++)
+			levelFlush(fs, &e->dpath[i]);
+		for(i = 0; i < 3; i++)
+			levelFlush(fs, &e->tpath[i]);
+		freeTree(fs, &run, in->dindirect, 2);
+		freeTree(fs, &run, in->tindirect, 3);
+	}
+	freeRunFlush(fs, &run);
+
+	//all the blocks are freed, mark this inode as invalid
+	trace(TRACE_INODE, TRACE_INFO, "deleted inode %d", inumber);
+	memset(in, 0, sizeof(*in));
+	e->dirty = 1;
+	//the mapping blocks are free now, don't write them back
+	inodeDropMaps(e);
+	pthread_mutex_lock(&fs->alloclock);
+	mapClear(&fs->fib, inumber);
+	pthread_mutex_unlock(&fs->alloclock);
+	flushBitmap(fs);
+
+	return 1;
+}
+
+int deleteFile(struct fs *fs, int inumber)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int result = 0;
+	if(inumber > 0 && inumber < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_wrlock(&e->lock);
+		result = inodeDelete(e);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return result;
+}
+
+//copy an indirect block and everything under it for a clone, depth 1
+//being a block of data block pointers.  The pointer blocks are copied,
+//the data blocks gain an owner.  Returns the copy, 0 when there is no
+//tree and -1 when the disk is full or a count would overflow
+int cloneTree(struct fs *fs, int blocknum, int depth)
+{
+	union fs_block block;
+	int k, id;
+
+	if (blocknum <= fs->ninodeblocks || blocknum >= fs->nblocks)
+		return 0;
+	id = getFreeBlock(fs);
+	if (id == -1)
+		return -1;
+	cache_read_r(fs->cache, blocknum, block.data);
+	for (k = 0; k < POINTERS_PER_BLOCK; k++)
+	{
+		int p = block.pointers[k];
+		if (p <= fs->ninodeblocks || p >= fs->nblocks)
+			p = 0;
+		else if (depth > 1)
+			p = cloneTree(fs, p, depth - 1);
+		else if (!refShare(fs, p, 1))
+			p = -1;
+		if (p == -1)
+		{
+			//hand back what the copy holds so far
+			struct free_run run = { 0, 0 };
+			memset(&block.pointers[k], 0, (POINTERS_PER_BLOCK - k) * sizeof(int));
+			cache_write_r(fs->cache, id, block.data);
+			freeTree(fs, &run, id, depth);
+			freeRunFlush(fs, &run);
+			return -1;
+		}
+		block.pointers[k] = p;
+	}
+	cache_write_r(fs->cache, id, block.data);
+	return id;
+}
+
+//what a clone takes from its source: the inode, with dindirect and
+//tindirect pointing at copies of the trees, and the extent list or the
+//indirect block's pointers.  Every data block in it has been given an
+//owner, which the clone inherits
+struct clone_map {
+	struct fs_inode inode;
+	struct extent *ext;
+	int nextents;
+	int *indirect;
+};
+
+//give back the owners a snapshot holds when no clone is made of it
+void cloneDrop(struct fs *fs, struct clone_map *m)
+{
+	struct fs_inode *in = &m->inode;
+	struct free_run run = { 0, 0 };
+	int i, b;
+
+	for(i = 0; m->ext && i < m->nextents; i++)
+	{
+		for(b = m->ext[i].start; m->ext[i].start && b < m->ext[i].start + m->ext[i].length; b++)
+			freeRunAdd(fs, &run, b);
+	}
+	if(!(fs->features & FS_FEATURE_EXTENTS) && !(in->flags & INODE_FLAG_INLINE))
+	{
+		for(i = 0; i < POINTERS_PER_INODE; i++)
+		{
+			if(in->direct[i] > 0 && in->direct[i] < fs->nblocks)
+				freeRunAdd(fs, &run, in->direct[i]);
+		}
+		for(i = 0; m->indirect && i < POINTERS_PER_BLOCK; i++)
+		{
+			if(m->indirect[i] > fs->ninodeblocks && m->indirect[i] < fs->nblocks)
+				freeRunAdd(fs, &run, m->indirect[i]);
+		}
+		freeTree(fs, &run, in->dindirect, 2);
+		freeTree(fs, &run, in->tindirect, 3);
+	}
+	freeRunFlush(fs, &run);
+	free(m->ext);
+	free(m->indirect);
+	m->ext = NULL;
+	m->indirect = NULL;
+}
+
+//snapshot src for a clone, sharing its data blocks.  Only the mapping
+//is copied, never the data.  Caller holds src's lock for writing
+int cloneTake(struct inode_entry *src, struct clone_map *m)
+{
+	struct fs *fs = src->fs;
+	struct fs_inode *in = &m->inode;
+	int i, tree;
+
+	memset(m, 0, sizeof(*m));
+	if(!src->inode.isvalid)
+	{
+		printf("Error: inode is invalid\n");
+		return 0;
+	}
+
+	//buffered data is given its blocks so they can be shared, and the
+	//trees below are read back through the cache
+	if(src->npend && !pendFlush(src))
+		return 0;
+	for(i = 0; i < 2; i++)
+		levelFlush(fs, &src->dpath[i]);
+	for(i = 0; i < 3; i++)
+		levelFlush(fs, &src->tpath[i]);
+	*in = src->inode;
+	if(in->flags & INODE_FLAG_INLINE)
+		return 1;
+
+	if(fs->features & FS_FEATURE_EXTENTS)
+	{
+		memset(in->extent, 0, sizeof(in->extent));
+		in->nextents = 0;
+		in->overflow = 0;
+		if(!extentLoad(src) || !(m->ext = malloc((src->nextents + 1) * sizeof(struct extent))))
+			return 0;
+		for(i = 0; i < src->nextents; i++)
+		{
+			struct extent *x = &src->ext[i];
+			if(x->start && !refShare(fs, x->start, x->length))
+				goto fail;
+			m->ext[m->nextents++] = *x;
+		}
+		return 1;
+	}
+
+	memset(in->direct, 0, sizeof(in->direct));
+	in->indirect = in->dindirect = in->tindirect = 0;
+	for(i = 0; i < POINTERS_PER_INODE; i++)
+	{
+		int p = src->inode.direct[i];
+		if(p <= 0 || p >= fs->nblocks)
+			continue;
+		if(!refShare(fs, p, 1))
+			goto fail;
+		in->direct[i] = p;
+	}
+
+	int *from = inodeIndirect(src, 0);
+	if(from)
+	{
+		if(!(m->indirect = calloc(POINTERS_PER_BLOCK, sizeof(int))))
+			goto fail;
+		for(i = 0; i < POINTERS_PER_BLOCK; i++)
+		{
+			if(from[i] <= fs->ninodeblocks || from[i] >= fs->nblocks)
+				continue;
+			if(!refShare(fs, from[i], 1))
+				goto fail;
+			m->indirect[i] = from[i];
+		}
+	}
+
+	tree = cloneTree(fs, src->inode.dindirect, 2);
+	if(tree == -1)
+		goto fail;
+	in->dindirect = tree;
+	tree = cloneTree(fs, src->inode.tindirect, 3);
+	if(tree == -1)
+		goto fail;
+	in->tindirect = tree;
+	return 1;
+
+fail:
+	cloneDrop(fs, m);
+	return 0;
+}
+
+//hand a snapshot to the new inode dst, locked for writing.  On failure
+//the snapshot is left as it was
+int cloneGive(struct inode_entry *dst, struct clone_map *m)
+{
+	struct fs *fs = dst->fs;
+	int id = 0;
+
+	if(m->indirect && (id = getFreeBlock(fs)) == -1)
+		return 0;
+	inodeDropMaps(dst);
+	dst->inode = m->inode;
+	dst->dirty = 1;
+	if(m->indirect)
+	{
+		dst->inode.indirect = id;
+		dst->indirect = m->indirect;
+		dst->indirectdirty = 1;
+		m->indirect = NULL;
+	}
+	if(m->ext)
+	{
+		dst->ext = m->ext;
+		dst->nextents = dst->extcap = m->nextents;
+		dst->extdirty = 1;
+		m->ext = NULL;
+	}
+	return 1;
+}
+
+//the source is snapshotted under its own lock and the clone's inode
+//only allocated once that worked, so no call holds both
+int cloneFile(struct fs *fs, int inumber)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	struct clone_map m;
+	struct inode_entry *e;
+	int clone = 0, ok = 0;
+	if(!fs->nrefblocks)
+		printf("Error: this image has no reference counts to share blocks with\n");
+	else if(inumber > 0 && inumber < fs->ninodes)
+	{
+		e = inodeGet(fs, inumber);
+		pthread_rwlock_wrlock(&e->lock);
+		ok = cloneTake(e, &m);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+
+	if(ok)
+	{
+		clone = inodeAlloc(fs);
+		ok = 0;
+		if(clone)
+		{
+			e = inodeGet(fs, clone);
+			pthread_rwlock_wrlock(&e->lock);
+			ok = cloneGive(e, &m);
+			if(!ok)
+				inodeDelete(e);
+			pthread_rwlock_unlock(&e->lock);
+			inodePut(e);
+		}
+		if(!ok)
+			cloneDrop(fs, &m);
+	}
+	flushBitmap(fs);
+	pthread_rwlock_unlock(&fs->fslock);
+	trace(TRACE_INODE, TRACE_INFO, "cloned inode %d to %d", inumber, ok ? clone : 0);
+	return ok ? clone : 0;
+}
+
+int64_t fileSize(struct fs *fs, int inumber)
+{
+	if(!enterFile(fs))
+		return -1;
+
+	int64_t size = -1;
+	if(inumber > 0 && inumber < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_rdlock(&e->lock);
+		if(e->inode.isvalid)
+			size = inodeSize(&e->inode);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return size;
+}
+
+//keep the cache rawindow blocks ahead of a sequential reader that is
+//about to read blocks first..last.  Prefetches go out in batches of at
+//least half a window, one transfer per physically contiguous run.
+void readAhead(struct inode_entry *e, int first, int last)
+{
+	struct fs *fs = e->fs;
+	int fileblocks = (inodeSize(&e->inode) + blocksize - 1) / blocksize;
+	int end = last + 1 + e->rawindow;
+	int b, p, count;
+
+	if(end > fileblocks)
+		end = fileblocks;
+	if(e->ranext < first)
+		e->ranext = first;
+	if(e->ranext >= end || e->ranext - (last + 1) >= e->rawindow / 2)
+		return;
+
+	for(b = e->ranext; b < end; b += count)
+	{
+		count = 1;
+		p = fileBlock(e, b);
+		if(p <= 0 || p >= fs->nblocks)
+			continue;
+		while(b + count < end && p + count < fs->nblocks && fileBlock(e, b + count) == p + count)
+			count++;
+		cache_prefetch_r(fs->cache, p, count);
+	}
+	e->ranext = end;
+}
+
+//caller holds the entry lock for reading, so the inode and its
+//buffered data stay put, but the mapping caches are shared with other
+//readers and only touched under maplock
+int inodeRead(struct inode_entry *e, char *data, int length, int64_t offset)
+{
+	struct fs *fs = e->fs;
+	union fs_block datablock;
+	struct disk_io io[READ_BATCH];
+	int nio = 0;
+	int bytesread = 0;
+
+	struct fs_inode *in = &e->inode;
+	int64_t size = inodeSize(in);
+	if(!in->isvalid || offset >= size)
+		return 0;
+
+	if(length > size - offset)
+		length = size - offset;
+
+	//the inode block read to find the file already held its data
+	if(in->flags & INODE_FLAG_INLINE)
+	{
+		memcpy(data, in->data + offset, length);
+		return length;
+	}
+
+	//a read picking up where the last one stopped widens the window,
+	//anything else closes it
+	pthread_mutex_lock(&e->maplock);
+	if(offset == e->raoff)
+	{
+		e->rawindow = e->rawindow ? e->rawindow * 2 : READAHEAD_MIN;
+		if(e->rawindow > READAHEAD_MAX)
+			e->rawindow = READAHEAD_MAX;
+		readAhead(e, offset / blocksize, (offset + length - 1) / blocksize);
+	}
+	else
+	{
+		e->rawindow = 0;
+		e->ranext = 0;
+	}
+	e->raoff = offset + length;
+	pthread_mutex_unlock(&e->maplock);
+
+	while(bytesread < length)
+	{
+		int b = (offset + bytesread) / blocksize;
+		int boff = (offset + bytesread) % blocksize;
+		int n = blocksize - boff;
+		pthread_mutex_lock(&e->maplock);
+		int blocknum = fileBlock(e, b);
+		pthread_mutex_unlock(&e->maplock);
+		char *pend = blocknum ? NULL : pendData(e, b);
+		if(n > length - bytesread)
+			n = length - bytesread;
+
+		if(pend)
+		{
+			//written but not allocated yet
+			memcpy(data + bytesread, pend + boff, n);
+		}
+		else if(blocknum <= 0 || blocknum >= fs->nblocks)
+		{
+			//never written, reads back as zeros
+			memset(data + bytesread, 0, n);
+		}
+		else if(n == blocksize)
+		{
+			//whole blocks are gathered and read together, so
+			//neighbours on disk go out as one transfer
+			io[nio].blocknum = blocknum;
+			io[nio].data = data + bytesread;
+			if(++nio == READ_BATCH)
+			{
+				cache_readv_r(fs->cache, io, nio);
+				nio = 0;
+			}
+		}
+		else
+		{
+			cache_read_r(fs->cache, blocknum, datablock.data);
+			memcpy(data + bytesread, datablock.data + boff, n);
+		}
+		bytesread += n;
+	}
+	cache_readv_r(fs->cache, io, nio);
+
+	return bytesread;
+}
+
+int readFile(struct fs *fs, int inumber, char *data, int length, int64_t offset)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int bytesread = 0;
+	if(inumber > 0 && inumber < fs->ninodes && length >= 0 && offset >= 0)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_rdlock(&e->lock);
+		bytesread = inodeRead(e, data, length, offset);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return bytesread;
+}
+
+//caller holds the entry lock for writing
+int inodeWrite(struct inode_entry *e, const char *data, int length, int64_t offset)
+{
+	struct fs *fs = e->fs;
+	union fs_block datablock;
+	int byteswritten = 0;
+
+	struct fs_inode *in = &e->inode;
+	if(!in->isvalid)
+	{
+		printf("Error: inode is invalid\n");
+		return 0;
+	}
+
+	int64_t maxsize = maxFileSize(fs);
+	if(offset >= maxsize)
+		return 0;
+	if(length > maxsize - offset)
+		length = maxsize - offset;
+
+	//small files stay in the inode until a write reaches past it
+	if(in->flags & INODE_FLAG_INLINE)
+	{
+		if(offset + length <= inlineMax(fs))
+		{
+			memcpy(in->data + offset, data, length);
+			if(offset + length > inodeSize(in))
+				inodeSetSize(in, offset + length);
+			e->dirty = 1;
+			return length;
+		}
+		if(!inodeSpill(e))
+			return 0;
+	}
+
+	while(byteswritten < length)
+	{
+		int b = (offset + byteswritten) / blocksize;
+		int boff = (offset + byteswritten) % blocksize;
+		int n = blocksize - boff;
+		int fresh;
+		if(n > length - byteswritten)
+			n = length - byteswritten;
+
+		//data landing in a hole is buffered, its block is chosen at
+		//flush time along with the rest of the file's new data
+		char *pend = pendData(e, b);
+		int blocknum = pend ? 0 : fileBlock(e, b);
+		if(!pend && (blocknum <= 0 || blocknum >= fs->nblocks))
+		{
+			//a block of zeros over a hole changes nothing
+			if(n == blocksize && zeroBlock(data + byteswritten))
+			{
+				byteswritten += n;
+				continue;
+			}
+			//flushing also turns reservations into real blocks
+			//before anything is allocated past them
+			if(!pendRoom(fs))
+				pendFlushAll(e);
+			if(pendRoom(fs))
+				pend = pendAdd(e, b);
+		}
+		if(pend)
+		{
+			memcpy(pend + boff, data + byteswritten, n);
+			byteswritten += n;
+			continue;
+		}
+
+		blocknum = fileWriteBlock(e, b, &fresh, n != blocksize);
+		if(blocknum == -1) break;
+
+		if(n == blocksize)
+		{
+			//whole block overwritten, no need to read it first
+			cache_write_r(fs->cache, blocknum, data + byteswritten);
+		}
+		else
+		{
+			if(fresh)
+				memset(datablock.data, 0, blocksize);
+			else
+				cache_read_r(fs->cache, blocknum, datablock.data);
+			memcpy(datablock.data + boff, data + byteswritten, n);
+			cache_write_r(fs->cache, blocknum, datablock.data);
+		}
+		byteswritten += n;
+	}
+
+	if(byteswritten == 0 && length > 0)
+		printf("Error: No free blocks found\n");
+
+	if(offset + byteswritten > inodeSize(in))
+	{
+		inodeSetSize(in, offset + byteswritten);
+		e->dirty = 1;
+	}
+	flushBitmap(fs);
+
+	return byteswritten;
+}
+
+//move an inline file's data out to an ordinary block, so the file can
+//grow past what fits in the inode.  caller holds the entry lock for
+//writing
+int inodeSpill(struct inode_entry *e)
+{
+	struct fs_inode *in = &e->inode;
+	char data[INODE_INLINE_MAX];
+	int size = in->size;
+
+	trace(TRACE_INODE, TRACE_DEBUG, "inode %d: spilling %d inline bytes", e->inumber, size);
+	memcpy(data, in->data, size);
+	memset(in->data, 0, sizeof(in->data));
+	in->flags &= ~INODE_FLAG_INLINE;
+	in->size = 0;
+	e->dirty = 1;
+	if(size && inodeWrite(e, data, size, 0) != size)
+	{
+		//no room for the block, the file stays as it was
+		memcpy(in->data, data, size);
+		in->flags |= INODE_FLAG_INLINE;
+		in->size = size;
+		return 0;
+	}
+	return 1;
+}
+
+int writeFile(struct fs *fs, int inumber, const char *data, int length, int64_t offset)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int byteswritten = 0;
+	if(inumber > 0 && inumber < fs->ninodes && length >= 0 && offset >= 0)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_wrlock(&e->lock);
+		if(e->inode.flags & INODE_FLAG_DIR)
+			printf("Error: inode is a directory\n");
+		else
+			byteswritten = inodeWrite(e, data, length, offset);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return byteswritten;
+}
+
+//whether logical block b holds data, on disk or still buffered.  caller
+//holds the entry lock, and maplock unless it holds it for writing
+int blockHasData(struct inode_entry *e, int b)
+{
+	if(e->inode.flags & INODE_FLAG_INLINE)
+		return 1;
+	int p = fileBlock(e, b);
+	return (p > 0 && p < e->fs->nblocks) || pendData(e, b) != NULL;
+}
+
+//where the data or hole containing or following offset starts, see fs_seek
+int64_t inodeSeek(struct inode_entry *e, int64_t offset, int whence)
+{
+	int64_t size = inodeSize(&e->inode);
+	if(!e->inode.isvalid || offset < 0 || offset >= size)
+		return -1;
+
+	int last = (size - 1) / blocksize;
+	int b;
+	pthread_mutex_lock(&e->maplock);
+	for(b = offset / blocksize; b <= last; b++)
+	{
+		if(blockHasData(e, b) == (whence == FS_SEEK_DATA))
+			break;
+	}
+	pthread_mutex_unlock(&e->maplock);
+
+	if(b > last)
+		return whence == FS_SEEK_DATA ? -1 : size;
+	int64_t pos = (int64_t) b * blocksize;
+	return pos > offset ? pos : offset;
+}
+
+//zero length bytes of a host file, as a hole where its filesystem can
+//punch one
+int hostZero(int fd, int64_t offset, int64_t length)
+{
+	union fs_block zero;
+
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		return 1;
+	memset(zero.data, 0, blocksize);
+	while(length > 0)
+	{
+		int n = length < blocksize ? length : blocksize;
+		if(pwrite(fd, zero.data, n, offset) != n)
+			return 0;
+		offset += n;
+		length -= n;
+	}
+	return 1;
+}
+
+//copy from a host file straight into the file's blocks.  Partial
+//blocks at either end go through inodeWrite; everything between is
+//mapped and handed to the disk one contiguous run at a time, except
+//ranges the host file has as holes, which stay holes here too.
+//caller holds the entry lock for writing
+int64_t inodeImport(struct inode_entry *e, int fd, int64_t offset, int64_t length)
+{
+	struct fs *fs = e->fs;
+	union fs_block datablock;
+	int64_t done = 0;
+	int pastb = -1, pastfresh = 0;
+
+	struct fs_inode *in = &e->inode;
+	if(!in->isvalid)
+	{
+		printf("Error: inode is invalid\n");
+		return 0;
+	}
+
+	int64_t maxsize = maxFileSize(fs);
+	if(offset >= maxsize)
+		return 0;
+	if(length > maxsize - offset)
+		length = maxsize - offset;
+
+	//a small enough import stays inline, a bigger one moves the file
+	//to blocks before any are copied in
+	if(in->flags & INODE_FLAG_INLINE)
+	{
+		if(offset + length <= inlineMax(fs))
+		{
+			if(pread(fd, datablock.data, length, offset) != length)
+				return 0;
+			return inodeWrite(e, datablock.data, length, offset);
+		}
+		if(!inodeSpill(e))
+			return 0;
+	}
+
+	//buffered blocks would land on top of the imported data at flush
+	if(e->npend && !pendFlush(e))
+		return 0;
+
+	while(done < length)
+	{
+		int64_t pos = offset + done;
+		int boff = pos % blocksize;
+		if(boff || length - done < blocksize)
+		{
+			int n = blocksize - boff;
+			if(n > length - done)
+				n = length - done;
+			if(pread(fd, datablock.data, n, pos) != n)
+				break;
+			int w = inodeWrite(e, datablock.data, n, pos);
+			done += w;
+			if(w != n)
+				break;
+			continue;
+		}
+
+		int b = pos / blocksize;
+		int64_t left = (length - done) / blocksize;
+
+		//the host's holes, where it can tell us, are skipped; blocks
+		//this file already had there are zeroed instead
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if(data < 0 && errno == ENXIO)
+			data = offset + length;
+		if(data > pos)
+		{
+			int64_t skip = (data - pos) / blocksize;
+			if(skip > left)
+				skip = left;
+			if(skip > 0)
+			{
+				int k;
+				memset(datablock.data, 0, blocksize);
+				for(k = 0; k < skip; k++)
+				{
+					if(blockHasData(e, b + k) &&
+					   inodeWrite(e, datablock.data, blocksize, pos + (int64_t) k * blocksize) != blocksize)
+						break;
+				}
+				done += (int64_t) k * blocksize;
+				if(k < skip)
+					break;
+				continue;
+			}
+		}
+		off_t hole = lseek(fd, pos, SEEK_HOLE);
+		if(hole > pos && (hole - pos + blocksize - 1) / blocksize < left)
+			left = (hole - pos + blocksize - 1) / blocksize;
+
+		//shared blocks are copied whole, so a transfer that fails leaves
+		//them as they were
+		int fresh, run = 1, next = 0, k;
+		char isnew[COPY_RUN];
+		int first = fileWriteBlock(e, b, &fresh, 1);
+		if(first == -1)
+			break;
+		//a block mapped past the end of the last run is picked up here,
+		//and is still new if it was new then
+		isnew[0] = b == pastb ? pastfresh : fresh;
+		pastb = -1;
+		while(run < left && run < COPY_RUN)
+		{
+			next = fileWriteBlock(e, b + run, &fresh, 1);
+			if(next != first + run)
+			{
+				if(next > 0)
+				{
+					pastb = b + run;
+					pastfresh = fresh;
+				}
+				break;
+			}
+			isnew[run++] = fresh;
+		}
+		if(!cache_copyin_r(fs->cache, first, run, fd, pos))
+		{
+			//blocks mapped for this run, and the one past it, go
+			//back to being holes instead of showing stale disk data
+			for(k = 0; k < run; k++)
+			{
+				if(isnew[k])
+					unmapBlock(e, b + k, first + k);
+			}
+			if(pastb == b + run && pastfresh)
+				unmapBlock(e, pastb, next);
+			break;
+		}
+		done += (int64_t) run * blocksize;
+	}
+
+	if(done == 0 && length > 0)
+		printf("Error: No free blocks found\n");
+
+	if(offset + done > inodeSize(in))
+	{
+		inodeSetSize(in, offset + done);
+		e->dirty = 1;
+	}
+	flushBitmap(fs);
+
+	return done;
+}
+
+//the reverse: allocated whole blocks go from the image straight to the
+//host file and holes are punched in it, while partial blocks and data
+//not yet given a block are read through inodeRead.  caller holds the
+//entry lock for reading
+int64_t inodeExport(struct inode_entry *e, int fd, int64_t offset, int64_t length)
+{
+	struct fs *fs = e->fs;
+	union fs_block datablock;
+	struct stat info;
+	int64_t done = 0;
+
+	struct fs_inode *in = &e->inode;
+	int64_t size = inodeSize(in);
+	if(!in->isvalid || offset >= size)
+		return 0;
+	if(length > size - offset)
+		length = size - offset;
+
+	//no blocks to copy, the bytes are in the inode
+	if(in->flags & INODE_FLAG_INLINE)
+		return pwrite(fd, in->data + offset, length, offset) == length ? length : 0;
+
+	while(done < length)
+	{
+		int64_t pos = offset + done;
+		int64_t left = (length - done) / blocksize;
+		int boff = pos % blocksize;
+		int b = pos / blocksize;
+		int run = 1;
+
+		pthread_mutex_lock(&e->maplock);
+		int first = fileBlock(e, b);
+		int mapped = first > 0 && first < fs->nblocks;
+		int hole = !mapped && !pendData(e, b);
+		if(!boff && left > 0)
+		{
+			while(run < left && run < COPY_RUN && (hole ?
+			      !blockHasData(e, b + run) : fileBlock(e, b + run) == first + run))
+				run++;
+		}
+		pthread_mutex_unlock(&e->maplock);
+
+		if(!boff && left > 0 && hole)
+		{
+			if(!hostZero(fd, pos, (int64_t) run * blocksize))
+				break;
+		}
+		else if(!boff && left > 0 && mapped)
+		{
+			if(!cache_copyout_r(fs->cache, first, run, fd, pos))
+				break;
+		}
+		else
+		{
+			int n = blocksize - boff;
+			if(n > length - done)
+				n = length - done;
+			int r = inodeRead(e, datablock.data, n, pos);
+			if(r <= 0 || pwrite(fd, datablock.data, r, pos) != r)
+				break;
+			done += r;
+			continue;
+		}
+		done += (int64_t) run * blocksize;
+	}
+
+	//punching holes doesn't stretch the host file over a trailing one
+	if(done > 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size < offset + done)
+	{
+		if(ftruncate(fd, offset + done) != 0)
+			return 0;
+	}
+
+	return done;
+}
+
+int64_t importFile(struct fs *fs, int inumber, int fd, int64_t offset, int64_t length)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int64_t done = 0;
+	if(inumber > 0 && inumber < fs->ninodes && length >= 0 && offset >= 0)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_wrlock(&e->lock);
+		if(e->inode.flags & INODE_FLAG_DIR)
+			printf("Error: inode is a directory\n");
+		else
+			done = inodeImport(e, fd, offset, length);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return done;
+}
+
+int64_t seekFile(struct fs *fs, int inumber, int64_t offset, int whence)
+{
+	if(!enterFile(fs))
+		return -1;
+
+	int64_t result = -1;
+	if(inumber > 0 && inumber < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_rdlock(&e->lock);
+		result = inodeSeek(e, offset, whence);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return result;
+}
+
+int64_t exportFile(struct fs *fs, int inumber, int fd, int64_t offset, int64_t length)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int64_t done = 0;
+	if(inumber > 0 && inumber < fs->ninodes && length >= 0 && offset >= 0)
+	{
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_rdlock(&e->lock);
+		done = inodeExport(e, fd, offset, length);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return done;
+}
+
+//FNV-1a, directory entries are placed by it so it can never change
+unsigned nameHash(const char *name)
+{
+	unsigned hash = 2166136261u;
+	for(; *name; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+int nameValid(const char *name)
+{
+	return name && *name && strlen(name) <= FS_NAME_MAX;
+}
+
+//the directory calls below hold the entry lock, for writing if they
+//change the directory
+int dirHead(struct inode_entry *e, struct fs_dirhead *h)
+{
+	if(!e->inode.isvalid || !(e->inode.flags & INODE_FLAG_DIR))
+		return 0;
+	return inodeRead(e, (char *) h, sizeof(*h), 0) == sizeof(*h) &&
+		h->magic == DIR_MAGIC && h->nbuckets > 0 && !(h->nbuckets & (h->nbuckets - 1));
+}
+
+int dirPutHead(struct inode_entry *e, const struct fs_dirhead *h)
+{
+	return inodeWrite(e, (const char *) h, sizeof(*h), 0) == sizeof(*h);
+}
+
+int dirBucket(struct inode_entry *e, int b, union fs_block *block)
+{
+	return inodeRead(e, block->data, DISK_BLOCK_SIZE, (int64_t) (b + 1) * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+int dirPutEntry(struct inode_entry *e, int slot, const struct fs_dirent *d)
+{
+	return inodeWrite(e, (const char *) d, sizeof(*d),
+		DISK_BLOCK_SIZE + (int64_t) slot * sizeof(*d)) == sizeof(*d);
+}
+
+//slot holding name, or -1.  *freeslot gets the first slot on the way
+//a new entry could take, and *reuse whether that slot held a removed
+//entry.  the search stops at the first block with a never used slot,
+//since nothing was ever pushed on past it
+int dirFind(struct inode_entry *e, const struct fs_dirhead *h, const char *name, unsigned hash,
+	int *inumber, int *freeslot, int *reuse)
+{
+	union fs_block block;
+	struct fs_dirent *d = block.dirents;
+	int i, k;
+
+	if(freeslot)
+		*freeslot = -1;
+	for(i = 0; i < h->nbuckets; i++)
+	{
+		int b = (hash + i) & (h->nbuckets - 1);
+		int open = 0;
+		if(!dirBucket(e, b, &block))
+			return -1;
+		for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+		{
+			if(d[k].inumber == 0 || d[k].inumber == DIR_REMOVED)
+			{
+				if(freeslot && *freeslot == -1)
+				{
+					*freeslot = b * DIRENTS_PER_BLOCK + k;
+					*reuse = d[k].inumber == DIR_REMOVED;
+				}
+				open |= d[k].inumber == 0;
+				continue;
+			}
+			if(d[k].hash == hash && !strncmp(d[k].name, name, FS_NAME_MAX + 1))
+			{
+				if(inumber)
+					*inumber = d[k].inumber;
+				return b * DIRENTS_PER_BLOCK + k;
+			}
+		}
+		if(open)
+			break;
+	}
+	return -1;
+}
+
+//rebuild the table with nbuckets blocks, dropping removed entries
+int dirResize(struct inode_entry *e, struct fs_dirhead *h, int nbuckets)
+{
+	union fs_block block;
+	struct fs_dirent *d = block.dirents;
+	int nslots = nbuckets * DIRENTS_PER_BLOCK;
+	int b, k, i;
+
+	if((int64_t) nbuckets * DISK_BLOCK_SIZE > INT_MAX)
+		return 0;
+	struct fs_dirent *table = calloc(nbuckets, DISK_BLOCK_SIZE);
+	if(!table)
+		return 0;
+	trace(TRACE_INODE, TRACE_INFO, "inode %d: directory of %d entries to %d blocks", e->inumber, h->count, nbuckets);
+
+	for(b = 0; b < h->nbuckets; b++)
+	{
+		if(!dirBucket(e, b, &block))
+		{
+			free(table);
+			return 0;
+		}
+		for(k = 0; k < DIRENTS_PER_BLOCK; k++)
+		{
+			if(d[k].inumber == 0 || d[k].inumber == DIR_REMOVED)
+				continue;
+			for(i = (d[k].hash & (nbuckets - 1)) * DIRENTS_PER_BLOCK; table[i].inumber; i = (i + 1) % nslots);
+			table[i] = d[k];
+		}
+	}
+
+	int length = nbuckets * DISK_BLOCK_SIZE;
+	int ok = inodeWrite(e, (char *) table, length, DISK_BLOCK_SIZE) == length;
+	free(table);
+	if(!ok)
+		return 0;
+	h->nbuckets = nbuckets;
+	h->removed = 0;
+	return dirPutHead(e, h);
+}
+
+//set up an empty directory in a freshly created inode
+int dirInit(struct inode_entry *e)
+{
+	struct fs_dirhead h = { DIR_MAGIC, 1, 0, 0 };
+	static const char zero[DISK_BLOCK_SIZE];
+
+	e->inode.flags = INODE_FLAG_DIR;
+	e->dirty = 1;
+	//the bucket is a hole until an entry lands in it
+	return dirPutHead(e, &h) && inodeWrite(e, zero, DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+int dirLookup(struct inode_entry *e, const char *name)
+{
+	struct fs_dirhead h;
+	int inumber = 0;
+
+	if(!nameValid(name) || !dirHead(e, &h))
+		return 0;
+	dirFind(e, &h, name, nameHash(name), &inumber, NULL, NULL);
+	return inumber;
+}
+
+int dirLink(struct inode_entry *e, const char *name, int inumber)
+{
+	struct fs_dirhead h;
+	struct fs_dirent d;
+	unsigned hash = nameHash(name);
+	int slot, reuse;
+
+	if(!nameValid(name) || !dirHead(e, &h))
+		return 0;
+	if(dirFind(e, &h, name, hash, NULL, &slot, &reuse) != -1)
+		return 0;	//name is taken
+
+	//keep at least a quarter of the slots never used, so searches
+	//stop after a block or two
+	if((int64_t) (h.count + h.removed + 1) * 4 > (int64_t) h.nbuckets * DIRENTS_PER_BLOCK * 3)
+	{
+		int nbuckets = h.nbuckets;
+		while((int64_t) (h.count + 1) * 2 > (int64_t) nbuckets * DIRENTS_PER_BLOCK)
+			nbuckets *= 2;
+		if(!dirResize(e, &h, nbuckets))
+			return 0;
+		dirFind(e, &h, name, hash, NULL, &slot, &reuse);
+	}
+	if(slot == -1)
+		return 0;
+
+	memset(&d, 0, sizeof(d));
+	d.inumber = inumber;
+	d.hash = hash;
+	strcpy(d.name, name);
+	if(!dirPutEntry(e, slot, &d))
+		return 0;
+	h.count++;
+	if(reuse)
+		h.removed--;
+	return dirPutHead(e, &h);
+}
+
+int dirUnlink(struct inode_entry *e, const char *name)
+{
+	struct fs_dirhead h;
+	struct fs_dirent d;
+
+	if(!nameValid(name) || !dirHead(e, &h))
+		return 0;
+	int slot = dirFind(e, &h, name, nameHash(name), NULL, NULL, NULL);
+	if(slot == -1)
+		return 0;
+
+	//the slot can't go back to never used, entries past it may have
+	//been pushed on over it
+	memset(&d, 0, sizeof(d));
+	d.inumber = DIR_REMOVED;
+	if(!dirPutEntry(e, slot, &d))
+		return 0;
+	h.count--;
+	h.removed++;
+	return dirPutHead(e, &h);
+}
+
+//the next live entry at or after slot *cookie
+int dirRead(struct inode_entry *e, int *cookie, char *name, int *inumber)
+{
+	union fs_block block;
+	struct fs_dirhead h;
+	int slot;
+
+	if(*cookie < 0 || !dirHead(e, &h))
+		return 0;
+	for(slot = *cookie; slot < h.nbuckets * DIRENTS_PER_BLOCK; )
+	{
+		if(!dirBucket(e, slot / DIRENTS_PER_BLOCK, &block))
+			return 0;
+		do
+		{
+			struct fs_dirent *d = &block.dirents[slot % DIRENTS_PER_BLOCK];
+			slot++;
+			if(d->inumber == 0 || d->inumber == DIR_REMOVED)
+				continue;
+			memcpy(name, d->name, FS_NAME_MAX + 1);
+			name[FS_NAME_MAX] = 0;
+			*inumber = d->inumber;
+			*cookie = slot;
+			return 1;
+		} while(slot % DIRENTS_PER_BLOCK);
+	}
+	*cookie = slot;
+	return 0;
+}
+
+int makeDir(struct fs *fs)
+{
+	int inumber = createFile(fs);
+	if(!inumber || !enterFile(fs))
+		return 0;
+
+	struct inode_entry *e = inodeGet(fs, inumber);
+	pthread_rwlock_wrlock(&e->lock);
+	//32-byte inodes have no flags to mark a directory with
+	if(fs->inodesize < INODE_SIZE_LARGE)
+		printf("Error: this image's inodes can't hold a directory\n");
+	int ok = fs->inodesize >= INODE_SIZE_LARGE && dirInit(e);
+	if(!ok)
+		inodeDelete(e);
+	pthread_rwlock_unlock(&e->lock);
+	inodePut(e);
+	pthread_rwlock_unlock(&fs->fslock);
+	return ok ? inumber : 0;
+}
+
+int lookupName(struct fs *fs, int dir, const char *name)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int inumber = 0;
+	if(dir > 0 && dir < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, dir);
+		pthread_rwlock_rdlock(&e->lock);
+		inumber = dirLookup(e, name);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return inumber;
+}
+
+int linkName(struct fs *fs, int dir, const char *name, int inumber)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int result = 0;
+	if(dir > 0 && dir < fs->ninodes && inumber > 0 && inumber < fs->ninodes)
+	{
+		//the target is checked first, never holding two entry locks
+		struct inode_entry *e = inodeGet(fs, inumber);
+		pthread_rwlock_rdlock(&e->lock);
+		int valid = e->inode.isvalid;
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+
+		if(valid)
+		{
+			e = inodeGet(fs, dir);
+			pthread_rwlock_wrlock(&e->lock);
+			result = dirLink(e, name, inumber);
+			pthread_rwlock_unlock(&e->lock);
+			inodePut(e);
+			flushBitmap(fs);
+		}
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return result;
+}
+
+int unlinkName(struct fs *fs, int dir, const char *name)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int result = 0;
+	if(dir > 0 && dir < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, dir);
+		pthread_rwlock_wrlock(&e->lock);
+		result = dirUnlink(e, name);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return result;
+}
+
+int readDir(struct fs *fs, int dir, int *cookie, char *name, int *inumber)
+{
+	if(!enterFile(fs))
+		return 0;
+
+	int result = 0;
+	if(dir > 0 && dir < fs->ninodes)
+	{
+		struct inode_entry *e = inodeGet(fs, dir);
+		pthread_rwlock_rdlock(&e->lock);
+		result = dirRead(e, cookie, name, inumber);
+		pthread_rwlock_unlock(&e->lock);
+		inodePut(e);
+	}
+	pthread_rwlock_unlock(&fs->fslock);
+	return result;
+}
+
+void syncDisk(struct fs *fs)
+{
+	pthread_rwlock_wrlock(&fs->fslock);
+	if (fs->mounted)
+	{
+		inodeFlushAll(fs);
+		flushBitmap(fs);
+	}
+	cache_sync_r(fs->cache);
+	pthread_rwlock_unlock(&fs->fslock);
+}
+
+//the per-file entry points, timed and counted in fs->stats.  Block
+//I/O the disk does while one runs is charged to it, see stats.h
+int fs_create_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_CREATE], &t);
+	int inumber = createFile(fs);
+	stats_end(&t, 0);
+	return inumber;
+}
+
+int fs_delete_r( struct fs *fs, int inumber )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_DELETE], &t);
+	int result = deleteFile(fs, inumber);
+	stats_end(&t, 0);
+	return result;
+}
+
+int fs_clone_r( struct fs *fs, int inumber )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_CLONE], &t);
+	int clone = cloneFile(fs, inumber);
+	stats_end(&t, 0);
+	return clone;
+}
+
+int64_t fs_getsize_r( struct fs *fs, int inumber )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_GETSIZE], &t);
+	int64_t size = fileSize(fs, inumber);
+	stats_end(&t, 0);
+	return size;
+}
+
+int fs_read_r( struct fs *fs, int inumber, char *data, int length, int64_t offset )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_READ], &t);
+	int bytesread = readFile(fs, inumber, data, length, offset);
+	stats_end(&t, bytesread);
+	return bytesread;
+}
+
+int fs_write_r( struct fs *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_WRITE], &t);
+	int byteswritten = writeFile(fs, inumber, data, length, offset);
+	stats_end(&t, byteswritten);
+	return byteswritten;
+}
+
+int64_t fs_import_r( struct fs *fs, int inumber, int fd, int64_t offset, int64_t length )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_IMPORT], &t);
+	int64_t done = importFile(fs, inumber, fd, offset, length);
+	stats_end(&t, done);
+	return done;
+}
+
+int64_t fs_export_r( struct fs *fs, int inumber, int fd, int64_t offset, int64_t length )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_EXPORT], &t);
+	int64_t done = exportFile(fs, inumber, fd, offset, length);
+	stats_end(&t, done);
+	return done;
+}
+
+int fs_mkdir_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_MKDIR], &t);
+	int inumber = makeDir(fs);
+	stats_end(&t, 0);
+	return inumber;
+}
+
+int fs_lookup_r( struct fs *fs, int dir, const char *name )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_LOOKUP], &t);
+	int inumber = lookupName(fs, dir, name);
+	stats_end(&t, 0);
+	return inumber;
+}
+
+int fs_link_r( struct fs *fs, int dir, const char *name, int inumber )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_LINK], &t);
+	int result = linkName(fs, dir, name, inumber);
+	stats_end(&t, 0);
+	return result;
+}
+
+int fs_unlink_r( struct fs *fs, int dir, const char *name )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_UNLINK], &t);
+	int result = unlinkName(fs, dir, name);
+	stats_end(&t, 0);
+	return result;
+}
+
+int fs_readdir_r( struct fs *fs, int dir, int *cookie, char *name, int *inumber )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_READDIR], &t);
+	int result = readDir(fs, dir, cookie, name, inumber);
+	stats_end(&t, 0);
+	return result;
+}
+
+int64_t fs_seek_r( struct fs *fs, int inumber, int64_t offset, int whence )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_SEEK], &t);
+	int64_t result = seekFile(fs, inumber, offset, whence);
+	stats_end(&t, 0);
+	return result;
+}
+
+void fs_sync_r( struct fs *fs )
+{
+	struct stats_timer t;
+	stats_begin(&fs->stats.op[FS_OP_SYNC], &t);
+	syncDisk(fs);
+	stats_end(&t, 0);
+}
+
+void fs_get_stats_r( struct fs *fs, struct fs_stats *s )
+{
+	stats_copy(s->op, fs->stats.op, FS_NOPS);
+}
+
+void fs_reset_stats_r( struct fs *fs )
+{
+	stats_clear(fs->stats.op, FS_NOPS);
+}
+
+const char *fs_op_name( int op )
+{
+	static const char * const names[FS_NOPS] = {
+		"format", "mount", "unmount", "sync", "debug",
+		"create", "delete", "getsize", "read", "write",
+		"import", "export", "seek", "mkdir", "lookup",
+		"link", "unlink", "readdir", "clone"
+	};
+	return op >= 0 && op < FS_NOPS ? names[op] : "?";
+}
+
+void fsInit(struct fs *fs, struct disk *disk, struct cache *cache)
+{
+	fs->disk = disk;
+	fs->cache = cache;
+	pthread_rwlock_init(&fs->fslock, NULL);
+	pthread_mutex_init(&fs->icachelock, NULL);
+	pthread_cond_init(&fs->islotfree, NULL);
+	pthread_mutex_init(&fs->alloclock, NULL);
+	inodeReset(fs);
+}
+
+//a filesystem on d with a block cache of its own, ready to format or
+//mount.  d stays open after fs_close, it belongs to the caller.
+struct fs *fs_open( struct disk *d )
+{
+	struct fs *fs = calloc(1, sizeof(struct fs));
+	if(!fs)
+		return NULL;
+	struct cache *cache = cache_open(d, CACHE_DEFAULT_FRAMES);
+	if(!cache)
+	{
+		free(fs);
+		return NULL;
+	}
+	fsInit(fs, d, cache);
+	return fs;
+}
+
+void fs_close( struct fs *fs )
+{
+	fs_unmount_r(fs);
+	inodeReset(fs);
+	bitmap_free(&fs->fbb.bits);
+	bitmap_free(&fs->fib.bits);
+	free(fs->fbb.dirty);
+	free(fs->fib.dirty);
+	refFree(&fs->refs);
+	cache_close_r(fs->cache);
+	pthread_rwlock_destroy(&fs->fslock);
+	pthread_mutex_destroy(&fs->icachelock);
+	pthread_cond_destroy(&fs->islotfree);
+	pthread_mutex_destroy(&fs->alloclock);
+	free(fs);
+}
+
+//the instance behind the calls without an fs argument, on the
+//default cache and so on whichever image disk_init opened
+struct fs defaultfs;
+pthread_once_t defaultonce = PTHREAD_ONCE_INIT;
+
+void defaultInit()
+{
+	fsInit(&defaultfs, NULL, cache_default());
+}
+
+struct fs *fs_default()
+{
+	pthread_once(&defaultonce, defaultInit);
+	return &defaultfs;
+}
+
+void fs_debug()
+{
+	fs_debug_r(fs_default());
+}
+
+int fs_format()
+{
+	return fs_format_opts_r(fs_default(), 0);
+}
+
+int fs_format_opts( int flags )
+{
+	return fs_format_opts_r(fs_default(), flags);
+}
+
+int fs_mount()
+{
+	return fs_mount_r(fs_default());
+}
+
+int fs_unmount()
+{
+	return fs_unmount_r(fs_default());
+}
+
+void fs_sync()
+{
+	fs_sync_r(fs_default());
+}
+
+int fs_create()
+{
+	return fs_create_r(fs_default());
+}
+
+int fs_delete( int inumber )
+{
+	return fs_delete_r(fs_default(), inumber);
+}
+
+int fs_clone( int inumber )
+{
+	return fs_clone_r(fs_default(), inumber);
+}
+
+int64_t fs_getsize( int inumber )
+{
+	return fs_getsize_r(fs_default(), inumber);
+}
+
+int fs_read( int inumber, char *data, int length, int64_t offset )
+{
+	return fs_read_r(fs_default(), inumber, data, length, offset);
+}
+
+int fs_write( int inumber, const char *data, int length, int64_t offset )
+{
+	return fs_write_r(fs_default(), inumber, data, length, offset);
+}
+
+int64_t fs_import( int inumber, int fd, int64_t offset, int64_t length )
+{
+	return fs_import_r(fs_default(), inumber, fd, offset, length);
+}
+
+int64_t fs_export( int inumber, int fd, int64_t offset, int64_t length )
+{
+	return fs_export_r(fs_default(), inumber, fd, offset, length);
+}
+
+int64_t fs_seek( int inumber, int64_t offset, int whence )
+{
+	return fs_seek_r(fs_default(), inumber, offset, whence);
+}
+
+int fs_mkdir()
+{
+	return fs_mkdir_r(fs_default());
+}
+
+int fs_lookup( int dir, const char *name )
+{
+	return fs_lookup_r(fs_default(), dir, name);
+}
+
+int fs_link( int dir, const char *name, int inumber )
+{
+	return fs_link_r(fs_default(), dir, name, inumber);
+}
+
+int fs_unlink( int dir, const char *name )
+{
+	return fs_unlink_r(fs_default(), dir, name);
+}
+
+int fs_readdir( int dir, int *cookie, char *name, int *inumber )
+{
+	return fs_readdir_r(fs_default(), dir, cookie, name, inumber);
+}
+
+void fs_get_stats( struct fs_stats *s )
+{
+	fs_get_stats_r(fs_default(), s);
+}
+
+void fs_reset_stats()
+{
+	fs_reset_stats_r(fs_default());
 }
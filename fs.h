@@ -1,15 +1,133 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+#include "stats.h"
+
+#define FS_FORMAT_EXTENTS 0x1
+#define FS_FORMAT_LAZY    0x2	//leave the inode table to be zeroed as it fills
+#define FS_FORMAT_INLINE  0x4	//256-byte inodes holding small files' data
+
+//whence for fs_seek, as SEEK_DATA and SEEK_HOLE for lseek
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+//one set of counters per entry point, see fs_get_stats
+#define FS_OP_FORMAT  0
+#define FS_OP_MOUNT   1
+#define FS_OP_UNMOUNT 2
+#define FS_OP_SYNC    3
+#define FS_OP_DEBUG   4
+#define FS_OP_CREATE  5
+#define FS_OP_DELETE  6
+#define FS_OP_GETSIZE 7
+#define FS_OP_READ    8
+#define FS_OP_WRITE   9
+#define FS_OP_IMPORT  10
+#define FS_OP_EXPORT  11
+#define FS_OP_SEEK    12
+#define FS_OP_MKDIR   13
+#define FS_OP_LOOKUP  14
+#define FS_OP_LINK    15
+#define FS_OP_UNLINK  16
+#define FS_OP_READDIR 17
+#define FS_OP_CLONE   18
+#define FS_NOPS       19
+
+//longest name a directory entry holds
+#define FS_NAME_MAX 55
+
+struct fs_stats {
+	struct op_stats op[FS_NOPS];
+};
+
+struct disk;
+struct fs;
+
 void fs_debug();
 int  fs_format();
+int  fs_format_opts( int flags );
 int  fs_mount();
+int  fs_unmount();
+void fs_sync();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+
+// A new file with the same contents as inumber, returning its inumber
+// or 0.  The two share data blocks until either writes to one, which
+// then gets a copy of its own, so cloning costs the same few metadata
+// writes however big the file is.
+int  fs_clone( int inumber );
+
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+
+// Copy length bytes between a host file descriptor and the same offset
+// in a file, returning how many were copied.  Whole blocks go straight
+// between the host file and the image without passing through memory.
+int64_t fs_import( int inumber, int fd, int64_t offset, int64_t length );
+int64_t fs_export( int inumber, int fd, int64_t offset, int64_t length );
+
+// The first offset at or after offset where data (FS_SEEK_DATA) or a
+// hole (FS_SEEK_HOLE) starts, the end of the file counting as a hole.
+// -1 when offset is past the end or no data follows it.  Holes are
+// whole blocks that were never written, and read back as zeros.
+int64_t fs_seek( int inumber, int64_t offset, int whence );
+
+// Directories are inodes holding a table of names hashed into blocks,
+// so a lookup reads the same few blocks however big the directory is.
+// fs_mkdir makes an empty one and returns its inumber, 0 on failure.
+// fs_link adds name for inumber, failing if the name is taken; fs_unlink
+// removes the name only, the file stays until fs_delete.  fs_lookup
+// gives the inumber for a name or 0.  fs_readdir returns the entries
+// one per call, in no particular order, with *cookie starting at 0 and
+// 0 returned once they run out.  Images still on 32-byte inodes can't
+// hold directories.
+int  fs_mkdir();
+int  fs_lookup( int dir, const char *name );
+int  fs_link( int dir, const char *name, int inumber );
+int  fs_unlink( int dir, const char *name );
+int  fs_readdir( int dir, int *cookie, char *name, int *inumber );
+
+void fs_get_stats( struct fs_stats *s );
+void fs_reset_stats();
+const char *fs_op_name( int op );
+
+// The calls above work on one default filesystem over the image opened
+// by disk_init.  Each has an _r form taking the filesystem to use, so
+// several images can be mounted and used at once from different threads.
+
+struct fs *fs_open( struct disk *d );
+void fs_close( struct fs *fs );
+struct fs *fs_default();
+
+void fs_debug_r( struct fs *fs );
+int  fs_format_opts_r( struct fs *fs, int flags );
+int  fs_mount_r( struct fs *fs );
+int  fs_unmount_r( struct fs *fs );
+void fs_sync_r( struct fs *fs );
+
+int  fs_create_r( struct fs *fs );
+int  fs_delete_r( struct fs *fs, int inumber );
+int  fs_clone_r( struct fs *fs, int inumber );
+int64_t fs_getsize_r( struct fs *fs, int inumber );
+
+int  fs_read_r( struct fs *fs, int inumber, char *data, int length, int64_t offset );
+int  fs_write_r( struct fs *fs, int inumber, const char *data, int length, int64_t offset );
+int64_t fs_import_r( struct fs *fs, int inumber, int fd, int64_t offset, int64_t length );
+int64_t fs_export_r( struct fs *fs, int inumber, int fd, int64_t offset, int64_t length );
+int64_t fs_seek_r( struct fs *fs, int inumber, int64_t offset, int whence );
+
+int  fs_mkdir_r( struct fs *fs );
+int  fs_lookup_r( struct fs *fs, int dir, const char *name );
+int  fs_link_r( struct fs *fs, int dir, const char *name, int inumber );
+int  fs_unlink_r( struct fs *fs, int dir, const char *name );
+int  fs_readdir_r( struct fs *fs, int dir, int *cookie, char *name, int *inumber );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+void fs_get_stats_r( struct fs *fs, struct fs_stats *s );
+void fs_reset_stats_r( struct fs *fs );
 
 #endif
@@ -0,0 +1,481 @@
+/*
+Benchmark suite for the filesystem: formats scratch images and runs a
+fixed set of workloads against them, writing one JSON object per result
+so runs can be compared before and after a change.
+
+	seqwrite/seqread  copyin/copyout style 16K transfers at several file sizes
+	randread          4K reads at random offsets into a 16MB file, cold cache
+	churn             create, write 8K, delete
+	smallwrite/read   100 byte files in blocks and inline in the inode
+	link/lookup       names added to one directory, then looked up at
+	                  random with a cold cache
+	clone/cowwrite    clones of a 4MB file, then 4K writes at random into
+	                  the clones, each copying the block it lands on
+	format            format time on the same images, writing the whole
+	                  inode table and leaving it to be zeroed lazily
+	mount/remount     mount time on 5 to 200000 block images, with the
+	                  bitmaps trusted (clean) and rebuilt (dirty)
+
+Every result carries the operation count, throughput, latency
+percentiles in microseconds and the block reads and writes the disk
+saw while it ran.  Seeds are fixed so two runs do the same work.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fs.h"
+#include "disk.h"
+
+#define CHUNK      16384	//same transfer size as the shell's copyin/copyout
+#define IMAGEBLOCKS 8192
+#define SEQTOTAL   (16*1024*1024)
+#define SEQMAXFILES 256
+#define RANDSIZE   (16*1024*1024)
+#define RANDREADS  4096
+#define RANDLEN    4096
+#define CHURN      2000
+#define CHURNLEN   8192
+#define SMALLFILES 1000
+#define SMALLLEN   100
+#define DIRENTRIES 100000
+#define DIRLOOKUPS 2000
+#define CLONESIZE  (4*1024*1024)
+#define CLONES     20
+#define COWWRITES  1000
+#define MOUNTREPS  5
+
+static FILE *out;
+static const char *image = "fsbench.img";
+static char buf[CHUNK];
+
+struct result {
+	const char *name;
+	int64_t param;
+	int ops;
+	int64_t bytes;
+	double secs;
+	double *lat;
+	struct disk_stats io;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int cmpdouble( const void *a, const void *b )
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x<y ? -1 : x>y;
+}
+
+static double percentile( double *lat, int n, int p )
+{
+	int i = (int)((int64_t)n*p/100);
+	if(i>=n) i = n-1;
+	return lat[i]*1e6;
+}
+
+static void start( struct result *r, struct disk *d, const char *name, int64_t param, int maxops )
+{
+	memset(r,0,sizeof(*r));
+	r->name = name;
+	r->param = param;
+	r->lat = malloc(sizeof(double)*maxops);
+	disk_get_stats_r(d,&r->io);
+	r->secs = now();
+}
+
+static void finish( struct result *r, struct disk *d )
+{
+	struct disk_stats io;
+
+	r->secs = now()-r->secs;
+	disk_get_stats_r(d,&io);
+	r->io.reads = io.reads-r->io.reads;
+	r->io.writes = io.writes-r->io.writes;
+
+	qsort(r->lat,r->ops,sizeof(double),cmpdouble);
+	fprintf(out,"{\"bench\":\"%s\",\"param\":%lld,\"ops\":%d,\"bytes\":%lld,\"secs\":%.6f,"
+		"\"mbps\":%.2f,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+		"\"block_reads\":%d,\"block_writes\":%d}\n",
+		r->name,(long long)r->param,r->ops,(long long)r->bytes,r->secs,
+		r->secs>0 ? r->bytes/r->secs/1e6 : 0.0,
+		percentile(r->lat,r->ops,50),percentile(r->lat,r->ops,90),
+		percentile(r->lat,r->ops,99),percentile(r->lat,r->ops,100),
+		r->io.reads,r->io.writes);
+	fflush(out);
+	free(r->lat);
+}
+
+/* Time one call: the caller does the work between tick and tock. */
+
+static double tick()
+{
+	return now();
+}
+
+static void tock( struct result *r, double t, int64_t bytes )
+{
+	r->lat[r->ops++] = now()-t;
+	r->bytes += bytes;
+}
+
+/* A freshly formatted and mounted filesystem on its own cache. */
+
+static struct fs *fresh( struct disk *d, int flags )
+{
+	struct fs *fs = fs_open(d);
+	if(!fs || !fs_format_opts_r(fs,flags) || !fs_mount_r(fs)) {
+		fprintf(stderr,"fsbench: couldn't format %s\n",image);
+		exit(1);
+	}
+	return fs;
+}
+
+/* Drop the cache by remounting through a new instance. */
+
+static struct fs *cold( struct disk *d, struct fs *fs )
+{
+	fs_close(fs);
+	fs = fs_open(d);
+	if(!fs || !fs_mount_r(fs)) {
+		fprintf(stderr,"fsbench: couldn't remount %s\n",image);
+		exit(1);
+	}
+	return fs;
+}
+
+static void bench_seq( struct disk *d, int64_t size )
+{
+	int nfiles = SEQTOTAL/size;
+	int chunks = (size+CHUNK-1)/CHUNK;
+	int inumber[SEQMAXFILES];
+	struct result r;
+	int64_t off;
+	int i, n;
+	double t;
+
+	if(nfiles<1) nfiles = 1;
+	if(nfiles>SEQMAXFILES) nfiles = SEQMAXFILES;
+
+	struct fs *fs = fresh(d,0);
+
+	start(&r,d,"seqwrite",size,nfiles*chunks+1);
+	for(i=0;i<nfiles;i++) {
+		inumber[i] = fs_create_r(fs);
+		for(off=0;off<size;off+=CHUNK) {
+			n = size-off<CHUNK ? size-off : CHUNK;
+			memset(buf,i+off/CHUNK,n);
+			t = tick();
+			fs_write_r(fs,inumber[i],buf,n,off);
+			tock(&r,t,n);
+		}
+	}
+	t = tick();
+	fs_sync_r(fs);
+	tock(&r,t,0);
+	finish(&r,d);
+
+	fs = cold(d,fs);
+
+	start(&r,d,"seqread",size,nfiles*chunks);
+	for(i=0;i<nfiles;i++) {
+		for(off=0;off<size;off+=CHUNK) {
+			t = tick();
+			n = fs_read_r(fs,inumber[i],buf,CHUNK,off);
+			tock(&r,t,n);
+			if(n<=0 || buf[0]!=(char)(i+off/CHUNK)) {
+				fprintf(stderr,"fsbench: seqread got the wrong data\n");
+				exit(1);
+			}
+		}
+	}
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+static void bench_rand( struct disk *d )
+{
+	unsigned seed = 1;
+	struct result r;
+	int64_t off;
+	int inumber, i;
+	double t;
+
+	struct fs *fs = fresh(d,0);
+	inumber = fs_create_r(fs);
+	for(off=0;off<RANDSIZE;off+=CHUNK) {
+		memset(buf,off/CHUNK,CHUNK);
+		fs_write_r(fs,inumber,buf,CHUNK,off);
+	}
+	fs = cold(d,fs);
+
+	start(&r,d,"randread",RANDLEN,RANDREADS);
+	for(i=0;i<RANDREADS;i++) {
+		off = (int64_t)rand_r(&seed)%(RANDSIZE-RANDLEN);
+		t = tick();
+		tock(&r,t,fs_read_r(fs,inumber,buf,RANDLEN,off));
+	}
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+static void bench_churn( struct disk *d )
+{
+	struct result r;
+	int inumber, i;
+	double t;
+
+	struct fs *fs = fresh(d,0);
+	memset(buf,'c',CHURNLEN);
+
+	start(&r,d,"churn",CHURNLEN,CHURN);
+	for(i=0;i<CHURN;i++) {
+		t = tick();
+		inumber = fs_create_r(fs);
+		fs_write_r(fs,inumber,buf,CHURNLEN,0);
+		fs_delete_r(fs,inumber);
+		tock(&r,t,CHURNLEN);
+	}
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+static void bench_small( struct disk *d, int flags )
+{
+	int inumber[SMALLFILES];
+	struct result r;
+	int i, n;
+	double t;
+
+	struct fs *fs = fresh(d,flags);
+	memset(buf,'s',SMALLLEN);
+
+	start(&r,d,flags ? "smallwrite-inline" : "smallwrite",SMALLLEN,SMALLFILES+1);
+	for(i=0;i<SMALLFILES;i++) {
+		t = tick();
+		inumber[i] = fs_create_r(fs);
+		fs_write_r(fs,inumber[i],buf,SMALLLEN,0);
+		tock(&r,t,SMALLLEN);
+	}
+	t = tick();
+	fs_sync_r(fs);
+	tock(&r,t,0);
+	finish(&r,d);
+
+	fs = cold(d,fs);
+
+	start(&r,d,flags ? "smallread-inline" : "smallread",SMALLLEN,SMALLFILES);
+	for(i=0;i<SMALLFILES;i++) {
+		t = tick();
+		n = fs_read_r(fs,inumber[i],buf,CHUNK,0);
+		tock(&r,t,n);
+		if(n!=SMALLLEN || buf[0]!='s') {
+			fprintf(stderr,"fsbench: smallread got the wrong data\n");
+			exit(1);
+		}
+	}
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+static void bench_dir( struct disk *d )
+{
+	unsigned seed = 1;
+	struct result r;
+	char name[32];
+	int dir, inumber, i;
+	double t;
+
+	struct fs *fs = fresh(d,0);
+	dir = fs_mkdir_r(fs);
+	inumber = fs_create_r(fs);
+
+	start(&r,d,"link",DIRENTRIES,DIRENTRIES);
+	for(i=0;i<DIRENTRIES;i++) {
+		sprintf(name,"entry-%d",i);
+		t = tick();
+		fs_link_r(fs,dir,name,inumber);
+		tock(&r,t,0);
+	}
+	finish(&r,d);
+
+	fs = cold(d,fs);
+
+	start(&r,d,"lookup",DIRENTRIES,DIRLOOKUPS);
+	for(i=0;i<DIRLOOKUPS;i++) {
+		sprintf(name,"entry-%d",rand_r(&seed)%DIRENTRIES);
+		t = tick();
+		if(fs_lookup_r(fs,dir,name)!=inumber) {
+			fprintf(stderr,"fsbench: lookup of %s failed\n",name);
+			exit(1);
+		}
+		tock(&r,t,0);
+	}
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+static void bench_clone( struct disk *d )
+{
+	unsigned seed = 1;
+	struct result r;
+	int inumber[CLONES];
+	int64_t off;
+	int src, i;
+	double t;
+
+	struct fs *fs = fresh(d,0);
+	src = fs_create_r(fs);
+	memset(buf,'c',CHUNK);
+	for(off=0;off<CLONESIZE;off+=CHUNK) {
+		fs_write_r(fs,src,buf,CHUNK,off);
+	}
+	fs_sync_r(fs);
+
+	start(&r,d,"clone",CLONESIZE,CLONES+1);
+	for(i=0;i<CLONES;i++) {
+		t = tick();
+		inumber[i] = fs_clone_r(fs,src);
+		tock(&r,t,0);
+		if(!inumber[i]) {
+			fprintf(stderr,"fsbench: clone failed\n");
+			exit(1);
+		}
+	}
+	t = tick();
+	fs_sync_r(fs);
+	tock(&r,t,0);
+	finish(&r,d);
+
+	start(&r,d,"cowwrite",RANDLEN,COWWRITES+1);
+	for(i=0;i<COWWRITES;i++) {
+		off = (int64_t)(rand_r(&seed)%(CLONESIZE/RANDLEN))*RANDLEN;
+		t = tick();
+		fs_write_r(fs,inumber[rand_r(&seed)%CLONES],buf,RANDLEN,off);
+		tock(&r,t,RANDLEN);
+	}
+	t = tick();
+	fs_sync_r(fs);
+	tock(&r,t,0);
+	finish(&r,d);
+
+	fs_close(fs);
+}
+
+/* Clear the clean flag behind the filesystem's back, as a crash would. */
+
+static void mark_dirty( struct disk *d )
+{
+	char block[DISK_BLOCK_SIZE];
+	disk_read_r(d,0,block);
+	((int*)block)[5] = 0;
+	disk_write_r(d,0,block);
+}
+
+static void bench_mount( int nblocks )
+{
+	struct disk *d = disk_open(image,nblocks,DISK_BACKEND_STDIO);
+	struct result r;
+	int dirty, lazy, i;
+	double t;
+
+	if(!d) {
+		fprintf(stderr,"fsbench: couldn't open %s\n",image);
+		exit(1);
+	}
+
+	for(lazy=0;lazy<2;lazy++) {
+		start(&r,d,lazy ? "format-lazy" : "format",nblocks,1);
+		struct fs *fs = fs_open(d);
+		t = tick();
+		fs_format_opts_r(fs,lazy ? FS_FORMAT_LAZY : 0);
+		tock(&r,t,0);
+		finish(&r,d);
+		fs_close(fs);
+	}
+
+	fs_close(fresh(d,0));
+
+	for(dirty=0;dirty<2;dirty++) {
+		start(&r,d,dirty ? "remount" : "mount",nblocks,MOUNTREPS);
+		for(i=0;i<MOUNTREPS;i++) {
+			if(dirty) mark_dirty(d);
+			struct fs *fs = fs_open(d);
+			t = tick();
+			fs_mount_r(fs);
+			tock(&r,t,0);
+			fs_close(fs);
+		}
+		finish(&r,d);
+	}
+
+	disk_close_r(d);
+}
+
+int main( int argc, char *argv[] )
+{
+	static const int64_t sizes[] = { 4096, 65536, 1024*1024, 16*1024*1024 };
+	static const int mounts[] = { 5, 20, 200, 2000, 20000, 200000 };
+	int maxblocks = 200000;
+	int c, i;
+
+	out = stdout;
+	while((c=getopt(argc,argv,"o:f:m:"))!=-1) {
+		switch(c) {
+		case 'o':
+			out = fopen(optarg,"w");
+			if(!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			image = optarg;
+			break;
+		case 'm':
+			maxblocks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,"use: fsbench [-o results] [-f scratch image] [-m largest mount image]\n");
+			return 1;
+		}
+	}
+
+	struct disk *d = disk_open(image,IMAGEBLOCKS,DISK_BACKEND_STDIO);
+	if(!d) {
+		fprintf(stderr,"fsbench: couldn't open %s\n",image);
+		return 1;
+	}
+	for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		bench_seq(d,sizes[i]);
+	}
+	bench_rand(d);
+	bench_churn(d);
+	bench_small(d,0);
+	bench_small(d,FS_FORMAT_INLINE);
+	bench_dir(d);
+	bench_clone(d);
+	disk_close_r(d);
+	unlink(image);
+
+	for(i=0;i<sizeof(mounts)/sizeof(mounts[0]);i++) {
+		if(mounts[i]<=maxblocks) bench_mount(mounts[i]);
+		unlink(image);
+	}
+
+	if(out!=stdout) fclose(out);
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+Check for files and images past the 32-bit limits: formats a sparse
+image of 8GB, fills one file densely enough that its blocks sit beyond
+2GB into the image, and writes another sparsely at offsets straddling
+2GB and 4GB and beyond.  Then it unmounts, remounts and reads it all
+back, checking the data, the holes between and fs_getsize.  Runs once
+with block pointers and once with extents, and exits 1 on any mismatch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "disk.h"
+
+#define IMAGEBLOCKS (2*1024*1024)	//8GB, far more than is ever written
+#define CHUNK       (1024*1024)
+#define DENSE       ((int64_t)1536*1024*1024)
+#define GB          ((int64_t)1024*1024*1024)
+
+//sparse writes: where each starts and how long it is
+static const struct { int64_t offset; int length; } pieces[] = {
+	{ 0, 4096 },
+	{ 2*GB-1000, CHUNK },
+	{ 4*GB-513, CHUNK },
+	{ 4*GB+3*CHUNK, 100 },
+	{ 6*GB+12345, CHUNK },
+};
+#define NPIECES (sizeof(pieces)/sizeof(pieces[0]))
+
+static char buf[CHUNK], out[CHUNK];
+static int failed = 0;
+
+/* The byte at offset off of a file seeded with seed. */
+
+static void fill( char *data, int64_t off, int length, int seed )
+{
+	int i;
+
+	for(i=0;i<length;i++) {
+		uint64_t x = (uint64_t)(off+i)*0x9e3779b97f4a7c15ull+seed;
+		data[i] = x>>56;
+	}
+}
+
+static void check( int inumber, int64_t off, int length, int seed, const char *what )
+{
+	int n = fs_read(inumber,out,length,off);
+
+	fill(buf,off,length,seed);
+	if(n!=length || memcmp(buf,out,length)) {
+		printf("largetest: %s at %lld: read %d of %d bytes, %s\n",what,(long long)off,n,length,
+			n==length ? "wrong data" : "short");
+		failed++;
+	}
+}
+
+static void check_zero( int inumber, int64_t off, int length )
+{
+	int n = fs_read(inumber,out,length,off);
+	int i;
+
+	for(i=0;i<n && !out[i];i++);
+	if(n!=length || i<n) {
+		printf("largetest: hole at %lld doesn't read back as zeros\n",(long long)off);
+		failed++;
+	}
+}
+
+static void run( int flags )
+{
+	int64_t off, end = 0;
+	int dense, sparse;
+	unsigned i;
+
+	if(!fs_format_opts(flags|FS_FORMAT_LAZY) || !fs_mount()) {
+		printf("largetest: couldn't format the image\n");
+		exit(1);
+	}
+
+	dense = fs_create();
+	for(off=0;off<DENSE;off+=CHUNK) {
+		fill(buf,off,CHUNK,1);
+		if(fs_write(dense,buf,CHUNK,off)!=CHUNK) {
+			printf("largetest: dense write at %lld failed\n",(long long)off);
+			exit(1);
+		}
+	}
+
+	sparse = fs_create();
+	for(i=0;i<NPIECES;i++) {
+		fill(buf,pieces[i].offset,pieces[i].length,2);
+		if(fs_write(sparse,buf,pieces[i].length,pieces[i].offset)!=pieces[i].length) {
+			printf("largetest: write at %lld failed\n",(long long)pieces[i].offset);
+			exit(1);
+		}
+		if(pieces[i].offset+pieces[i].length>end) end = pieces[i].offset+pieces[i].length;
+	}
+
+	fs_unmount();
+	if(!fs_mount()) {
+		printf("largetest: couldn't remount the image\n");
+		exit(1);
+	}
+
+	if(fs_getsize(dense)!=DENSE || fs_getsize(sparse)!=end) {
+		printf("largetest: sizes %lld and %lld, expected %lld and %lld\n",
+			(long long)fs_getsize(dense),(long long)fs_getsize(sparse),(long long)DENSE,(long long)end);
+		failed++;
+	}
+	for(off=0;off<DENSE;off+=CHUNK) {
+		check(dense,off,CHUNK,1,"dense file");
+	}
+	for(i=0;i<NPIECES;i++) {
+		check(sparse,pieces[i].offset,pieces[i].length,2,"sparse file");
+	}
+	check_zero(sparse,GB,CHUNK);
+	check_zero(sparse,5*GB,CHUNK);
+
+	fs_unmount();
+	printf("largetest: %s done\n",(flags & FS_FORMAT_EXTENTS) ? "extents" : "block pointers");
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *image = argc>1 ? argv[1] : "largetest.img";
+
+	if(!disk_init(image,IMAGEBLOCKS)) {
+		printf("largetest: couldn't open %s\n",image);
+		return 1;
+	}
+
+	run(0);
+	run(FS_FORMAT_EXTENTS);
+
+	disk_close();
+	unlink(image);
+
+	printf("largetest: %s\n",failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -1,175 +1,511 @@
 #include "fs.h"
 #include "disk.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 
+static void usage( const char *program );
+static int run_commands( const char *commands );
+static int run_script( FILE *in );
+static int run_line( char *line );
+static int do_command( const char *line );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_map( int inumber );
+static void do_stats();
+static void do_ls( int dir );
+static int do_trace( int args, const char *arg1, const char *arg2 );
+
+static int timing = 0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	const char *commands = 0;
+	const char *script = 0;
+	int backend = DISK_BACKEND_STDIO;
+	int c, result = 1;
+	FILE *in;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((c=getopt(argc,argv,"mc:f:t"))!=-1) {
+		switch(c) {
+		case 'm':
+			backend = DISK_BACKEND_MMAP;
+			break;
+		case 'c':
+			commands = optarg;
+			break;
+		case 'f':
+			script = optarg;
+			break;
+		case 't':
+			timing = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(argc-optind!=2 || (commands && script)) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %d blocks\n",argv[optind],disk_size());
 
-	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+	if(commands) {
+		result = run_commands(commands);
+	} else if(script) {
+		in = strcmp(script,"-") ? fopen(script,"r") : stdin;
+		if(!in) {
+			printf("couldn't open %s: %s\n",script,strerror(errno));
+			result = 0;
+		} else {
+			result = run_script(in);
+			if(in!=stdin) fclose(in);
+		}
+	} else {
+		while(1) {
+			printf(" simplefs> ");
+			fflush(stdout);
+
+			if(!fgets(line,sizeof(line),stdin)) break;
+			if(run_line(line)<0) break;
+		}
+	}
+
+	fs_unmount();
+
+	printf("closing emulated disk.\n");
+	disk_close();
+
+	return result ? 0 : 1;
+}
+
+static void usage( const char *program )
+{
+	printf("use: %s [-m] [-t] [-c commands | -f script] <diskfile> <nblocks>\n",program);
+	printf("    -m  use the mmap backend\n");
+	printf("    -c  run the commands, separated by ';', instead of prompting\n");
+	printf("    -f  run the commands in script, one per line, '-' for stdin\n");
+	printf("    -t  report how long each command took on stderr\n");
+	printf("in -c and -f modes the shell stops at the first command that fails\n");
+	printf("and exits with status 1.\n");
+}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+/*
+Batch mode: every command runs in turn, without a prompt, until the
+list ends, a quit, or a command fails.  Returns 0 on a failure.
+*/
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+static int run_commands( const char *commands )
+{
+	char line[1024];
+	const char *end;
+	int len, result;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+	while(*commands) {
+		end = strchr(commands,';');
+		len = end ? end-commands : strlen(commands);
+		if(len>=sizeof(line)) {
+			printf("command too long: %.40s...\n",commands);
+			return 0;
+		}
+		memcpy(line,commands,len);
+		line[len] = 0;
+		commands += end ? len+1 : len;
 
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+		result = run_line(line);
+		if(result<0) break;
+		if(!result) return 0;
+	}
+	return 1;
+}
+
+static int run_script( FILE *in )
+{
+	char line[1024];
+	int result, lineno = 0;
+
+	while(fgets(line,sizeof(line),in)) {
+		lineno++;
+		result = run_line(line);
+		if(result<0) break;
+		if(!result) {
+			printf("stopped at line %d\n",lineno);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+One line of input: blank lines and # comments are skipped, and
+"repeat <n> <command>" runs the command n times, stopping at the first
+failure.  Returns 1 on success, 0 on failure and -1 for quit.
+*/
+
+static int run_line( char *line )
+{
+	char *cmd;
+	int count = 1, n = 0, runs, result = 1;
+	double start, ms;
+
+	line[strcspn(line,"\r\n")] = 0;
+	cmd = line+strspn(line," \t");
+	if(!*cmd || *cmd=='#') return 1;
+
+	if(!strncmp(cmd,"repeat",6) && (cmd[6]==' ' || cmd[6]=='\t')) {
+		if(sscanf(cmd+6,"%d %n",&count,&n)!=1 || count<1 || !cmd[6+n]) {
+			printf("use: repeat <count> <command>\n");
+			return 0;
+		}
+		cmd += 6+n;
+	}
+
+	start = now();
+	for(runs=0;runs<count && result>0;runs++) {
+		result = do_command(cmd);
+	}
+	if(timing && result>=0) {
+		ms = (now()-start)*1e3;
+		fprintf(stderr,"time: %s: %d x %.3f ms, %.3f ms total\n",cmd,runs,ms/runs,ms);
+	}
+	return result;
+}
+
+/*
+Format flags for the words after the command, or -1 if one of them is
+not an option format knows.
+*/
+
+static int format_options( const char *line )
+{
+	char word[1024];
+	int flags = 0, n;
+
+	sscanf(line,"%*s%n",&n);
+	for(line+=n;sscanf(line,"%1023s%n",word,&n)==1;line+=n) {
+		if(!strcmp(word,"extents")) {
+			flags |= FS_FORMAT_EXTENTS;
+		} else if(!strcmp(word,"lazy")) {
+			flags |= FS_FORMAT_LAZY;
+		} else if(!strcmp(word,"inline")) {
+			flags |= FS_FORMAT_INLINE;
+		} else {
+			return -1;
+		}
+	}
+	return flags;
+}
+
+static int do_command( const char *line )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	char arg3[1024];
+	int inumber, args;
+	int64_t size;
+
+	args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		int flags = format_options(line);
+		if(flags>=0) {
+			if(fs_format_opts(flags)) {
+				printf("disk formatted.\n");
 			} else {
-				printf("use: format\n");
-			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
+				printf("format failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: format [extents] [lazy] [inline]\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				printf("disk mounted.\n");
+			} else {
+				printf("mount failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: mount\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"unmount")) {
+		if(args==1) {
+			if(fs_unmount()) {
+				printf("disk unmounted.\n");
+			} else {
+				printf("unmount failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: unmount\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"sync")) {
+		if(args==1) {
+			fs_sync();
+			printf("disk synced.\n");
+		} else {
+			printf("use: sync\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			printf("use: debug\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			size = fs_getsize(inumber);
+			if(size>=0) {
+				printf("inode %d has size %lld\n",inumber,(long long)size);
+			} else {
+				printf("getsize failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: getsize <inumber>\n");
+			return 0;
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				printf("created inode %d\n",inumber);
+			} else {
+				printf("create failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: create\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(fs_delete(inumber)) {
+				printf("inode %d deleted.\n",inumber);
 			} else {
-				printf("use: mount\n");
+				printf("delete failed!\n");
+				return 0;
 			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
+		} else {
+			printf("use: delete <inumber>\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"clone")) {
+		if(args==2) {
+			inumber = fs_clone(atoi(arg1));
+			if(inumber>0) {
+				printf("cloned inode %d to inode %d\n",atoi(arg1),inumber);
 			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
+				printf("clone failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: clone <inumber>\n");
+			return 0;
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(!do_copyout(inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: cat <inumber>\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			inumber = atoi(arg2);
+			if(do_copyin(arg1,inumber)) {
+				printf("copied file %s to inode %d\n",arg1,inumber);
 			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
+				printf("copy failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: copyin <filename> <inumber>\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = atoi(arg1);
+			if(do_copyout(inumber,arg2)) {
+				printf("copied inode %d to file %s\n",inumber,arg2);
 			} else {
-				printf("use: create\n");
-			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
+				printf("copy failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: copyout <inumber> <filename>\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"map")) {
+		if(args==2) {
+			if(!do_map(atoi(arg1))) {
+				printf("map failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: map <inumber>\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"mkdir")) {
+		if(args==1) {
+			inumber = fs_mkdir();
+			if(inumber>0) {
+				printf("created directory %d\n",inumber);
 			} else {
-				printf("use: delete <inumber>\n");
-			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
+				printf("mkdir failed!\n");
+				return 0;
+			}
+		} else {
+			printf("use: mkdir\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"link")) {
+		if(args==4) {
+			if(fs_link(atoi(arg1),arg2,atoi(arg3))) {
+				printf("linked %s to inode %d\n",arg2,atoi(arg3));
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("link failed!\n");
+				return 0;
 			}
+		} else {
+			printf("use: link <dir> <name> <inode>\n");
+			return 0;
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"unlink")) {
+		if(args==3) {
+			if(fs_unlink(atoi(arg1),arg2)) {
+				printf("unlinked %s\n",arg2);
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("unlink failed!\n");
+				return 0;
 			}
+		} else {
+			printf("use: unlink <dir> <name>\n");
+			return 0;
+		}
 
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"lookup")) {
+		if(args==3) {
+			inumber = fs_lookup(atoi(arg1),arg2);
+			if(inumber>0) {
+				printf("%s is inode %d\n",arg2,inumber);
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
+				printf("%s not found!\n",arg2);
+				return 0;
+			}
 		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			printf("use: lookup <dir> <name>\n");
+			return 0;
 		}
-	}
 
-	printf("closing emulated disk.\n");
-	disk_close();
+	} else if(!strcmp(cmd,"ls")) {
+		if(args==2) {
+			do_ls(atoi(arg1));
+		} else {
+			printf("use: ls <dir>\n");
+			return 0;
+		}
+
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			do_stats();
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			fs_reset_stats();
+			disk_reset_stats();
+			printf("stats reset.\n");
+		} else {
+			printf("use: stats [reset]\n");
+			return 0;
+		}
 
-	return 0;
+	} else if(!strcmp(cmd,"trace")) {
+		return do_trace(args,arg1,arg2);
+
+	} else if(!strcmp(cmd,"help")) {
+		printf("Commands are:\n");
+		printf("    format  [extents] [lazy] [inline]\n");
+		printf("    mount\n");
+		printf("    unmount\n");
+		printf("    sync\n");
+		printf("    debug\n");
+		printf("    create\n");
+		printf("    delete  <inode>\n");
+		printf("    clone   <inode>\n");
+		printf("    cat     <inode>\n");
+		printf("    copyin  <file> <inode>\n");
+		printf("    copyout <inode> <file>\n");
+		printf("    map     <inode>\n");
+		printf("    mkdir\n");
+		printf("    link    <dir> <name> <inode>\n");
+		printf("    unlink  <dir> <name>\n");
+		printf("    lookup  <dir> <name>\n");
+		printf("    ls      <dir>\n");
+		printf("    stats   [reset]\n");
+		printf("    trace   [off|dump|ring|print|error|info|debug] [categories]\n");
+		printf("    repeat  <count> <command>\n");
+		printf("    help\n");
+		printf("    quit\n");
+		printf("    exit\n");
+	} else if(!strcmp(cmd,"quit") || !strcmp(cmd,"exit")) {
+		return -1;
+	} else {
+		printf("unknown command: %s\n",cmd);
+		printf("type 'help' for a list of commands.\n");
+		return 0;
+	}
+
+	return 1;
 }
 
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	struct stat info;
+	int64_t offset=0;
+	int result, actual, ok=1;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
@@ -178,6 +514,19 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	// a regular file goes over in one call, whole blocks straight
+	// from the host file into the image
+	if(!fstat(fileno(file),&info) && S_ISREG(info.st_mode)) {
+		offset = fs_import(inumber,fileno(file),0,info.st_size);
+		if(offset!=info.st_size) {
+			printf("WARNING: fs_import only copied %lld bytes, not %lld bytes\n",(long long)offset,(long long)info.st_size);
+			ok = 0;
+		}
+		printf("%lld bytes copied\n",(long long)offset);
+		fclose(file);
+		return ok;
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
@@ -185,26 +534,30 @@ static int do_copyin( const char *filename, int inumber )
 			actual = fs_write(inumber,buffer,result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
+				ok = 0;
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
 				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				ok = 0;
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
-	return 1;
+	return ok;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	struct stat info;
+	int64_t offset=0, size;
+	int result, ok=1;
 	char buffer[16384];
 
 	file = fopen(filename,"w");
@@ -213,6 +566,18 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
+	size = fs_getsize(inumber);
+	if(size>0 && !fstat(fileno(file),&info) && S_ISREG(info.st_mode)) {
+		offset = fs_export(inumber,fileno(file),0,size);
+		if(offset!=size) {
+			printf("WARNING: fs_export only copied %lld bytes, not %lld bytes\n",(long long)offset,(long long)size);
+			ok = 0;
+		}
+		printf("%lld bytes copied\n",(long long)offset);
+		fclose(file);
+		return ok;
+	}
+
 	while(1) {
 		result = fs_read(inumber,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
@@ -220,9 +585,98 @@ static int do_copyout( int inumber, const char *filename )
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
 	return 1;
 }
 
+/*
+List the ranges of a file holding data; everything else is a hole.
+*/
+
+static int do_map( int inumber )
+{
+	int64_t size = fs_getsize(inumber);
+	int64_t data, hole = 0, total = 0;
+
+	if(size<0) return 0;
+
+	while((data=fs_seek(inumber,hole,FS_SEEK_DATA))>=0) {
+		hole = fs_seek(inumber,data,FS_SEEK_HOLE);
+		printf("data %lld-%lld\n",(long long)data,(long long)hole);
+		total += hole-data;
+	}
+	printf("inode %d: %lld bytes, %lld in data ranges\n",inumber,(long long)size,(long long)total);
+	return 1;
+}
+
+static void do_stats()
+{
+	const char *fsnames[FS_NOPS], *disknames[DISK_NOPS];
+	struct fs_stats fs;
+	struct disk_stats disk;
+	int i;
+
+	fs_get_stats(&fs);
+	disk_get_stats(&disk);
+
+	for(i=0;i<FS_NOPS;i++) fsnames[i] = fs_op_name(i);
+	for(i=0;i<DISK_NOPS;i++) disknames[i] = disk_op_name(i);
+
+	stats_print(stdout,"fs op",fsnames,fs.op,FS_NOPS);
+	printf("\n");
+	stats_print(stdout,"disk op",disknames,disk.op,DISK_NOPS);
+	printf("\n%d disk block reads, %d disk block writes since the image was opened\n",disk.reads,disk.writes);
+	printf("%d of %d image blocks stored by the host\n",disk_allocated(),disk_size());
+}
+
+static void do_ls( int dir )
+{
+	char name[FS_NAME_MAX+1];
+	int cookie = 0, inumber, n = 0;
+
+	while(fs_readdir(dir,&cookie,name,&inumber)) {
+		printf("%8d %s\n",inumber,name);
+		n++;
+	}
+	printf("%d entries\n",n);
+}
+
+static int do_trace( int args, const char *arg1, const char *arg2 )
+{
+	static const char *levels[] = { "off", "error", "info", "debug" };
+	int level, cats;
+
+	if(!TRACE_COMPILED) {
+		printf("tracing is not compiled in, rebuild with make TRACE=1\n");
+		return 0;
+	}
+
+	if(args==1) {
+		printf("trace level %s, mode %s\n",levels[trace_level],trace_mode()==TRACE_RING ? "ring" : "print");
+		return 1;
+	}
+
+	if(args==2 && !strcmp(arg1,"dump")) {
+		printf("%d trace records.\n",trace_dump(stdout));
+		return 1;
+	}
+
+	if(args==2 && (!strcmp(arg1,"ring") || !strcmp(arg1,"print"))) {
+		trace_set(trace_level,trace_categories,!strcmp(arg1,"ring") ? TRACE_RING : TRACE_PRINT);
+		return 1;
+	}
+
+	for(level=0;level<4;level++) {
+		if(!strcmp(arg1,levels[level])) break;
+	}
+	cats = args==3 ? trace_category(arg2) : TRACE_ALL;
+	if(level==4 || cats<0) {
+		printf("use: trace [off|dump|ring|print]\n");
+		printf("     trace <error|info|debug> [fs,inode,alloc,cache,disk]\n");
+		return 0;
+	}
+	trace_set(level,cats,trace_mode());
+	return 1;
+}
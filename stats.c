@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+The operation each thread is inside of, so the disk can charge the
+blocks it moves to whichever filesystem call caused them.
+*/
+
+static __thread struct op_stats *current = 0;
+
+uint64_t stats_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void add( uint64_t *counter, uint64_t n )
+{
+	__atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+static int bucket( uint64_t ns )
+{
+	int b = ns ? 63-__builtin_clzll(ns) : 0;
+	return b<STATS_BUCKETS ? b : STATS_BUCKETS-1;
+}
+
+/*
+Count one call to op that started at start, by stats_clock.
+*/
+
+void stats_record( struct op_stats *op, uint64_t start, int64_t bytes )
+{
+	uint64_t ns = stats_clock()-start;
+	uint64_t max = __atomic_load_n(&op->max_ns,__ATOMIC_RELAXED);
+
+	add(&op->calls,1);
+	if(bytes>0) add(&op->bytes,bytes);
+	add(&op->total_ns,ns);
+	add(&op->hist[bucket(ns)],1);
+	while(ns>max && !__atomic_compare_exchange_n(&op->max_ns,&max,ns,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {}
+}
+
+/*
+Time a call to op and make it the one blocks are charged to.  Calls
+nest: blocks moved inside an inner call are charged to the inner one,
+and the outer one picks up again when it ends.
+*/
+
+void stats_begin( struct op_stats *op, struct stats_timer *t )
+{
+	t->op = op;
+	t->outer = current;
+	current = op;
+	t->start = stats_clock();
+}
+
+void stats_end( struct stats_timer *t, int64_t bytes )
+{
+	stats_record(t->op,t->start,bytes);
+	current = t->outer;
+}
+
+struct op_stats * stats_current()
+{
+	return current;
+}
+
+void stats_set_current( struct op_stats *op )
+{
+	current = op;
+}
+
+void stats_blocks( struct op_stats *op, int write, int n )
+{
+	if(op) add(write ? &op->block_writes : &op->block_reads,n);
+}
+
+/*
+A snapshot of n sets of counters, each field read atomically, so it
+can be taken while other threads keep counting.
+*/
+
+void stats_copy( struct op_stats *to, const struct op_stats *from, int n )
+{
+	const uint64_t *src = (const uint64_t *)from;
+	uint64_t *dst = (uint64_t *)to;
+	size_t i, words = n*sizeof(struct op_stats)/sizeof(uint64_t);
+
+	for(i=0;i<words;i++) dst[i] = __atomic_load_n(&src[i],__ATOMIC_RELAXED);
+}
+
+void stats_clear( struct op_stats *ops, int n )
+{
+	uint64_t *dst = (uint64_t *)ops;
+	size_t i, words = n*sizeof(struct op_stats)/sizeof(uint64_t);
+
+	for(i=0;i<words;i++) __atomic_store_n(&dst[i],0,__ATOMIC_RELAXED);
+}
+
+/*
+Latency in nanoseconds below which p percent of the calls finished,
+as the upper edge of the histogram bucket it falls in, or the slowest
+call if that came sooner.
+*/
+
+uint64_t stats_percentile( const struct op_stats *op, int p )
+{
+	uint64_t want, seen = 0;
+	int b;
+
+	if(!op->calls) return 0;
+
+	want = (op->calls*p+99)/100;
+	for(b=0;b<STATS_BUCKETS-1;b++) {
+		seen += op->hist[b];
+		if(seen>=want) break;
+	}
+	if(b==STATS_BUCKETS-1 || ((uint64_t)2<<b)>op->max_ns) return op->max_ns;
+	return (uint64_t)2<<b;
+}
+
+static void print_ns( FILE *f, uint64_t ns )
+{
+	if(ns<1000) {
+		fprintf(f,"%lluns",(unsigned long long)ns);
+	} else if(ns<1000000) {
+		fprintf(f,"%lluus",(unsigned long long)ns/1000);
+	} else if(ns<1000000000) {
+		fprintf(f,"%llums",(unsigned long long)ns/1000000);
+	} else {
+		fprintf(f,"%llus",(unsigned long long)ns/1000000000);
+	}
+}
+
+/*
+One line per operation that has been called, latencies in microseconds,
+then the non-empty histogram buckets of each as upper edge:count.
+*/
+
+void stats_print( FILE *f, const char *title, const char * const *names, const struct op_stats *ops, int n )
+{
+	int i;
+
+	fprintf(f,"%-10s %10s %12s %10s %10s %10s %10s %10s %10s\n",
+		title,"calls","bytes","blk reads","blk writes","mean us","p50 us","p99 us","max us");
+	for(i=0;i<n;i++) {
+		const struct op_stats *op = &ops[i];
+		if(!op->calls) continue;
+		fprintf(f,"%-10s %10llu %12llu %10llu %10llu %10.1f %10.1f %10.1f %10.1f\n",
+			names[i],
+			(unsigned long long)op->calls,
+			(unsigned long long)op->bytes,
+			(unsigned long long)op->block_reads,
+			(unsigned long long)op->block_writes,
+			op->total_ns/1e3/op->calls,
+			stats_percentile(op,50)/1e3,
+			stats_percentile(op,99)/1e3,
+			op->max_ns/1e3);
+	}
+
+	for(i=0;i<n;i++) {
+		const struct op_stats *op = &ops[i];
+		int b;
+		if(!op->calls) continue;
+		fprintf(f,"%-10s",names[i]);
+		for(b=0;b<STATS_BUCKETS;b++) {
+			if(!op->hist[b]) continue;
+			fprintf(f," %s",b<STATS_BUCKETS-1 ? "<" : ">=");
+			print_ns(f,b<STATS_BUCKETS-1 ? (uint64_t)2<<b : (uint64_t)1<<b);
+			fprintf(f,":%llu",(unsigned long long)op->hist[b]);
+		}
+		fprintf(f,"\n");
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_BUCKETS 32
+
+/*
+Counters for one kind of operation.  Bucket i of the histogram counts
+calls that took from 2^i up to 2^(i+1) nanoseconds; the first bucket
+also takes anything faster and the last anything slower.  Block reads
+and writes are the ones the disk carried out while the operation ran
+on this thread, including writebacks and read-ahead it set off.
+*/
+
+struct op_stats {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t block_reads;
+	uint64_t block_writes;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t hist[STATS_BUCKETS];
+};
+
+struct stats_timer {
+	struct op_stats *op;
+	struct op_stats *outer;
+	uint64_t start;
+};
+
+uint64_t stats_clock();
+void stats_record( struct op_stats *op, uint64_t start, int64_t bytes );
+void stats_begin( struct op_stats *op, struct stats_timer *t );
+void stats_end( struct stats_timer *t, int64_t bytes );
+
+struct op_stats *stats_current();
+void stats_set_current( struct op_stats *op );
+void stats_blocks( struct op_stats *op, int write, int n );
+
+void stats_copy( struct op_stats *to, const struct op_stats *from, int n );
+void stats_clear( struct op_stats *ops, int n );
+uint64_t stats_percentile( const struct op_stats *op, int p );
+void stats_print( FILE *f, const char *title, const char * const *names, const struct op_stats *ops, int n );
+
+#endif
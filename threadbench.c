@@ -0,0 +1,132 @@
+/*
+Stress benchmark for concurrent access: formats a scratch image, writes
+one file per thread, then has 1, 2, 4 and 8 threads read at once, each
+thread its own file and then all of them the same file, and reports the
+combined read rate.  A writer thread appending to a separate file runs
+alongside the last round so the readers contend with allocation too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "disk.h"
+
+#define MAXTHREADS 8
+#define FILESIZE   (512*1024)
+#define CHUNK      (64*1024)
+#define PASSES     64
+
+static int files[MAXTHREADS];
+static int shared = 0;
+static volatile int stop = 0;
+static int failed = 0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void *reader( void *arg )
+{
+	int t = (long)arg;
+	int inumber = shared ? files[0] : files[t];
+	char *buf = malloc(CHUNK);
+	int p, off;
+
+	for(p=0;p<PASSES;p++) {
+		for(off=0;off<FILESIZE;off+=CHUNK) {
+			if(fs_read(inumber,buf,CHUNK,off)!=CHUNK || buf[0]!=(char)(inumber+off/CHUNK)) {
+				__sync_fetch_and_add(&failed,1);
+			}
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void *writer( void *arg )
+{
+	int inumber = (long)arg;
+	char buf[4096];
+	int64_t off = 0;
+
+	memset(buf,'w',sizeof(buf));
+	while(!stop) {
+		if(fs_write(inumber,buf,sizeof(buf),off)!=sizeof(buf)) {
+			fs_delete(inumber);
+			inumber = fs_create();
+			off = 0;
+		} else {
+			off += sizeof(buf);
+		}
+	}
+	return 0;
+}
+
+static double run( int nthreads )
+{
+	pthread_t tid[MAXTHREADS];
+	double start = now();
+	long t;
+
+	for(t=0;t<nthreads;t++) pthread_create(&tid[t],0,reader,(void*)t);
+	for(t=0;t<nthreads;t++) pthread_join(tid[t],0);
+
+	return (double)nthreads*PASSES*FILESIZE/(now()-start)/1e6;
+}
+
+int main( int argc, char *argv[] )
+{
+	static const int counts[] = { 1, 2, 4, 8 };
+	const char *image = argc>1 ? argv[1] : "threadbench.img";
+	char *buf = malloc(CHUNK);
+	pthread_t wtid;
+	int i, off;
+
+	if(!disk_init(image,8192) || !fs_format() || !fs_mount()) {
+		printf("couldn't set up %s\n",image);
+		return 1;
+	}
+
+	for(i=0;i<MAXTHREADS;i++) {
+		files[i] = fs_create();
+		for(off=0;off<FILESIZE;off+=CHUNK) {
+			memset(buf,files[i]+off/CHUNK,CHUNK);
+			fs_write(files[i],buf,CHUNK,off);
+		}
+	}
+	fs_sync();
+
+	printf("%8s %16s %16s\n","threads","own file MB/s","same file MB/s");
+	for(i=0;i<sizeof(counts)/sizeof(counts[0]);i++) {
+		shared = 0;
+		double own = run(counts[i]);
+		shared = 1;
+		double same = run(counts[i]);
+		printf("%8d %16.1f %16.1f\n",counts[i],own,same);
+	}
+
+	stop = 0;
+	pthread_create(&wtid,0,writer,(void*)(long)fs_create());
+	shared = 0;
+	printf("%8d %16.1f %16s\n",MAXTHREADS,run(MAXTHREADS),"(with writer)");
+	stop = 1;
+	pthread_join(wtid,0);
+
+	fs_unmount();
+	disk_close();
+	free(buf);
+
+	if(failed) {
+		printf("%d reads returned the wrong data\n",failed);
+		return 1;
+	}
+	return 0;
+}
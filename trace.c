@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+int trace_level = 0;
+int trace_categories = TRACE_ALL;
+
+/*
+One event in ring mode.  Only the format pointer and the argument
+values are kept, formats being string literals that outlive the ring.
+*/
+
+struct record {
+	uint64_t ns;
+	const char *fmt;
+	unsigned char cat;
+	unsigned char level;
+	unsigned char nargs;
+	long long args[TRACE_MAXARGS];
+};
+
+static int mode = TRACE_PRINT;
+static struct record ring[TRACE_RING_SIZE];
+static uint64_t next = 0;
+
+static const char * const names[] = { "fs", "inode", "alloc", "cache", "disk" };
+#define NCATEGORIES (sizeof(names)/sizeof(names[0]))
+
+static uint64_t clock_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+/*
+Step over one conversion spec, fmt pointing just past the '%'.  Sets
+*wide when the argument is long or wider, *conv to the conversion
+character, and returns a pointer past the spec.
+*/
+
+static const char * parse_spec( const char *fmt, int *wide, char *conv )
+{
+	*wide = 0;
+	while(*fmt && strchr("-+ #0123456789.",*fmt)) fmt++;
+	while(*fmt && strchr("hlzjt",*fmt)) {
+		if(*fmt!='h') *wide = 1;
+		fmt++;
+	}
+	*conv = *fmt;
+	return *fmt ? fmt+1 : fmt;
+}
+
+void trace_emit( int cat, int level, const char *fmt, ... )
+{
+	const char *p;
+	struct record *r;
+	va_list va;
+	int wide;
+	char conv;
+
+	va_start(va,fmt);
+	if(mode==TRACE_PRINT) {
+		fprintf(stderr,"trace %s: ",trace_category_name(cat));
+		vfprintf(stderr,fmt,va);
+		fprintf(stderr,"\n");
+		va_end(va);
+		return;
+	}
+
+	r = &ring[__atomic_fetch_add(&next,1,__ATOMIC_RELAXED)%TRACE_RING_SIZE];
+	r->ns = clock_ns();
+	r->fmt = fmt;
+	r->cat = cat;
+	r->level = level;
+	r->nargs = 0;
+	for(p=fmt;(p=strchr(p,'%'));) {
+		if(p[1]=='%') {
+			p += 2;
+			continue;
+		}
+		p = parse_spec(p+1,&wide,&conv);
+		if(r->nargs==TRACE_MAXARGS || !conv) break;
+		if(wide) {
+			r->args[r->nargs++] = va_arg(va,long long);
+		} else if(strchr("uxXo",conv)) {
+			r->args[r->nargs++] = va_arg(va,unsigned);
+		} else {
+			r->args[r->nargs++] = va_arg(va,int);
+		}
+	}
+	va_end(va);
+}
+
+/*
+Level 0 switches tracing off.  Changing the mode empties the ring.
+*/
+
+void trace_set( int level, int categories, int m )
+{
+	trace_level = level;
+	trace_categories = categories;
+	if(m!=mode) {
+		mode = m;
+		next = 0;
+	}
+}
+
+int trace_mode()
+{
+	return mode;
+}
+
+static void print_record( FILE *f, const struct record *r, uint64_t base )
+{
+	const char *p, *spec;
+	char buf[32];
+	int i = 0, wide;
+	char conv;
+
+	fprintf(f,"%10.3f %s: ",(r->ns-base)/1e3,trace_category_name(r->cat));
+	for(p=r->fmt;*p;) {
+		if(*p!='%') {
+			fputc(*p++,f);
+		} else if(p[1]=='%') {
+			fputc('%',f);
+			p += 2;
+		} else {
+			spec = p;
+			p = parse_spec(p+1,&wide,&conv);
+			if(i==r->nargs || !conv) break;
+			//same flags and width, with the value always passed as long long
+			snprintf(buf,sizeof(buf),"%.*sll%c",(int)strspn(spec+1,"-+ #0123456789.")+1,spec,conv);
+			fprintf(f,buf,r->args[i++]);
+		}
+	}
+	fputc('\n',f);
+}
+
+/*
+Write the records held in the ring, oldest first, with times in
+microseconds since the oldest, and empty it.  Returns how many there
+were.  Records being written while the dump runs may come out torn.
+*/
+
+int trace_dump( FILE *f )
+{
+	uint64_t end = __atomic_load_n(&next,__ATOMIC_RELAXED);
+	uint64_t start = end>TRACE_RING_SIZE ? end-TRACE_RING_SIZE : 0;
+	uint64_t i;
+
+	for(i=start;i<end;i++) {
+		print_record(f,&ring[i%TRACE_RING_SIZE],ring[start%TRACE_RING_SIZE].ns);
+	}
+	__atomic_store_n(&next,0,__ATOMIC_RELAXED);
+
+	return end-start;
+}
+
+/*
+Category mask for a comma separated list of names, "all" for every
+category, or -1 if a name is not known.
+*/
+
+int trace_category( const char *list )
+{
+	char name[32];
+	int mask = 0, len;
+	unsigned i;
+
+	while(*list) {
+		len = strcspn(list,",");
+		if(len>=sizeof(name)) return -1;
+		memcpy(name,list,len);
+		name[len] = 0;
+		list += len;
+		if(*list) list++;
+
+		if(!strcmp(name,"all")) {
+			mask |= TRACE_ALL;
+			continue;
+		}
+		for(i=0;i<NCATEGORIES;i++) {
+			if(!strcmp(name,names[i])) break;
+		}
+		if(i==NCATEGORIES) return -1;
+		mask |= 1<<i;
+	}
+	return mask;
+}
+
+const char * trace_category_name( int cat )
+{
+	unsigned i;
+
+	for(i=0;i<NCATEGORIES;i++) {
+		if(cat==1<<i) return names[i];
+	}
+	return "?";
+}
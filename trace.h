@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#define TRACE_ERROR 1
+#define TRACE_INFO  2
+#define TRACE_DEBUG 3
+
+#define TRACE_FS    0x01	//format, mount, unmount
+#define TRACE_INODE 0x02	//inode create, delete and mapping
+#define TRACE_ALLOC 0x04	//block and inode allocation
+#define TRACE_CACHE 0x08
+#define TRACE_DISK  0x10
+#define TRACE_ALL   0x1f
+
+#define TRACE_PRINT 0	//format each record to stderr as it happens
+#define TRACE_RING  1	//keep the last TRACE_RING_SIZE records in memory
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_MAXARGS   6
+
+/*
+trace(category,level,format,...) records an event when tracing is
+switched on for that category at that level or above.  Unless the
+tree is built with TRACE defined (make TRACE=1) every call compiles
+to nothing, arguments included, so hot paths pay nothing for them.
+
+Arguments must be integers, since ring mode keeps the raw values and
+only formats them when the ring is dumped.
+*/
+
+extern int trace_level;
+extern int trace_categories;
+
+#ifdef TRACE
+#define TRACE_COMPILED 1
+#define trace(cat,level,...) \
+	do { \
+		if(trace_level>=(level) && (trace_categories&(cat))) trace_emit(cat,level,__VA_ARGS__); \
+	} while(0)
+#else
+#define TRACE_COMPILED 0
+#define trace(cat,level,...) ((void)0)
+#endif
+
+void trace_emit( int cat, int level, const char *fmt, ... );
+void trace_set( int level, int categories, int mode );
+int  trace_mode();
+int  trace_dump( FILE *f );
+int  trace_category( const char *names );
+const char *trace_category_name( int cat );
+
+#endif